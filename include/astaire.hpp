@@ -38,13 +38,17 @@
 #define ASTAIRE_H__
 
 #include "memcachedstoreview.h"
+#include "memcached_tap_client.hpp"
 #include "astaire_statistics.hpp"
+#include "rate_limiter.hpp"
 #include "updater.h"
 #include "alarm.h"
 
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <atomic>
 
 // Class that manages resyncing the local memcached node with the rest of the
 // cluster. This makes use of the memcached "tap protocol" to stream records
@@ -58,8 +62,14 @@
 // -  A control thread. This decides when to do a resync, what sort of resync
 //    to do (see below) and what taps to set up. It also handles raising alarms
 //    and PD logs.
-// -  Tap threads. These are spawned by the control thread when doing a resync.
-//    There is one thread per server being tapped.
+// -  Resync worker threads. These are spawned by the control thread when
+//    doing a resync. Each worker repeatedly picks some vbuckets that are
+//    ready to be streamed from a server and TAPs them, until there are none
+//    left. There are enough workers to run a configurable number of TAPs
+//    against each server at once.
+// -  A monitor thread. This holds a connection open to the local memcached so
+//    that it notices as soon as memcached restarts, and kicks the control
+//    thread when it does.
 // -  An updater thread that handles SIGHUP.  This updates the cluster view and
 //    kicks the control thread to do a partial resync.
 // -  An updater thread that handles SIGUSR1. This updates the cluster view and
@@ -94,11 +104,30 @@ public:
           Alarm* alarm,
           AstaireGlobalStatistics* global_stats,
           AstairePerConnectionStatistics* per_conn_stats,
-          std::string self);
+          std::string self,
+          int tap_fanout = DEFAULT_TAP_FANOUT,
+          uint64_t tap_bandwidth_limit = DEFAULT_TAP_BANDWIDTH_LIMIT,
+          uint64_t inject_rate_limit = DEFAULT_INJECT_RATE_LIMIT,
+          uint64_t inject_latency_target_us = DEFAULT_INJECT_LATENCY_TARGET_US,
+          std::string local_socket = "");
+
+  // The default maximum number of TAP connections to run against each server
+  // being streamed from.
+  static const int DEFAULT_TAP_FANOUT = 1;
+
+  // The default limits on the total number of bytes per second received over
+  // TAP, and on the total number of records per second injected into the
+  // local memcached. Zero means no limit.
+  static const uint64_t DEFAULT_TAP_BANDWIDTH_LIMIT = 10 * 1024 * 1024;
+  static const uint64_t DEFAULT_INJECT_RATE_LIMIT = 10000;
+
+  // The default target for the 99th percentile round trip time of a batch of
+  // requests to the local memcached while injecting. The injection rate is
+  // reduced while this is exceeded. Zero means the rate is not adjusted.
+  static const uint64_t DEFAULT_INJECT_LATENCY_TARGET_US = 10000;
 
   ~Astaire();
 
-  typedef std::map<std::string, std::vector<uint16_t>> TapList;
   typedef std::map<uint16_t, std::vector<std::string>> OutstandingWorkList;
 
   struct TapBucketsThreadData
@@ -107,13 +136,19 @@ public:
                          const std::string& local_server,
                          const std::vector<uint16_t>& buckets,
                          AstaireGlobalStatistics* global_stats,
-                         AstairePerConnectionStatistics::ConnectionRecord* conn_stats) :
+                         AstairePerConnectionStatistics::ConnectionRecord* conn_stats,
+                         RateLimiter* tap_limiter,
+                         RateLimiter* inject_limiter,
+                         LatencyController* inject_controller) :
       tap_server(tap_server),
       local_server(local_server),
       buckets(buckets),
       success(false),
       global_stats(global_stats),
-      conn_stats(conn_stats)
+      conn_stats(conn_stats),
+      tap_limiter(tap_limiter),
+      inject_limiter(inject_limiter),
+      inject_controller(inject_controller)
     {}
 
     std::string tap_server;
@@ -122,6 +157,15 @@ public:
     bool success;
     AstaireGlobalStatistics* global_stats;
     AstairePerConnectionStatistics::ConnectionRecord* conn_stats;
+
+    // Limiters shared by all TAPs, for the bytes received over TAP and the
+    // records injected into the local memcached.
+    RateLimiter* tap_limiter;
+    RateLimiter* inject_limiter;
+
+    // Adjusts the injection rate according to how quickly the local memcached
+    // is responding.
+    LatencyController* inject_controller;
   };
 
   // Static function called by the control thread.  This simply calls
@@ -131,6 +175,13 @@ public:
   // Method executed by the control thread.
   void control_thread();
 
+  // Static function called by the monitor thread.  This simply calls the
+  // `monitor_thread` member method.
+  static void* monitor_thread_fn(void* data);
+
+  // Method executed by the monitor thread.
+  void monitor_thread();
+
   // Reload the cluster config and kick off a new resync operation.  This is
   // called when Astaire receives a SIGHUP.
   void reload_config();
@@ -141,33 +192,103 @@ public:
   // This method reloads the cluster config before triggering the resync.
   void trigger_full_resync();
 
-  // Static entry point for TAP threads.  The argument must be a valid
-  // TapBucketsThreadData object.  Returns the same object with the `success`
-  // field updated appropriately.
+  // Perform the TAP specified by a TapBucketsThreadData object, which must be
+  // valid.  Returns the same object with the `success` field updated
+  // appropriately.  This is run by the resync workers.
   static void* tap_buckets_thread(void* data);
 
 private:
-  void do_resync(bool full_resync);
+  // A mutation received over TAP that is waiting to be injected into the
+  // local memcached.
+  struct PendingMutation
+  {
+    PendingMutation(uint16_t vbucket, const Memcached::MsgView& msg) :
+      vbucket(vbucket),
+      length(msg.length()),
+      mutate(msg)
+    {}
+
+    uint16_t vbucket;
+
+    // The length of the mutation as received over TAP.
+    uint32_t length;
+    Memcached::TapMutateReq mutate;
+  };
+
+  static void record_local_rtt(const struct timespec& start,
+                               uint32_t num_requests,
+                               TapBucketsThreadData* tap_data);
+  static bool inject_mutations(Memcached::ClientConnection& local_conn,
+                               std::vector<PendingMutation>& batch,
+                               TapBucketsThreadData* tap_data);
+
+  void do_resync(bool full_resync, uint64_t restart_generation);
   OutstandingWorkList calculate_worklist(bool full_resync);
-  void process_worklist(OutstandingWorkList& owl);
-  TapList calculate_taps(OutstandingWorkList& owl);
-  bool perform_single_tap(const std::string& server,
-                          const std::vector<uint16_t>& buckets,
-                          pthread_t* handle);
-  bool complete_single_tap(pthread_t thread_id,
-                           std::string& tap_server);
+  void process_worklist(OutstandingWorkList& owl, uint64_t restart_generation);
+
+  // The state of a resync, shared between the worker threads that are
+  // carrying it out. All fields are protected by `lock`.
+  struct ResyncWork
+  {
+    ResyncWork(Astaire* astaire,
+               const OutstandingWorkList& owl,
+               uint64_t restart_generation);
+    ~ResyncWork();
+
+    Astaire* astaire;
+
+    // The local memcached's restart generation when the resync started. If
+    // it changes, the local memcached has restarted and the resync is
+    // abandoned.
+    const uint64_t restart_generation;
+
+    // The replicas each vbucket was to be streamed from at the start of the
+    // resync. This is not changed once the resync has started.
+    const OutstandingWorkList sources;
+
+    // The replicas each vbucket still needs to be streamed from, primary
+    // first.
+    OutstandingWorkList owl;
+
+    // The vbuckets that are currently being streamed.
+    std::set<uint16_t> in_flight;
+
+    // The number of TAPs currently running to each server.
+    std::map<std::string, int> active_taps;
+
+    // The vbuckets that haven't yet been streamed from any replica.
+    std::set<int> unstreamed_buckets;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+  };
+  static void* resync_worker_thread_fn(void* data);
+  void resync_worker(ResyncWork& work);
+  bool next_tap(ResyncWork& work,
+                std::string& server,
+                std::vector<uint16_t>& buckets);
   void blacklist_server(OutstandingWorkList& owl, const std::string& server);
   static int owl_total_buckets(const OutstandingWorkList& owl);
   static bool owl_empty(const OutstandingWorkList& owl);
   static uint16_t vbucket_for_key(const std::string& key);
+  static uint16_t vbucket_for_key(const char* key, size_t key_length);
   bool update_view();
 
   enum PollResult { UP_TO_DATE, OUT_OF_DATE, ERROR };
   PollResult poll_local_memcached();
   bool tag_local_memcached();
   bool untag_local_memcached();
+  void skip_checkpointed_buckets(OutstandingWorkList& owl);
+  bool write_checkpoint(uint16_t vbucket,
+                        const std::vector<std::string>& replicas);
+  bool clear_checkpoints();
+  static std::string checkpoint_key(uint16_t vbucket);
+  static std::string checkpoint_value(const std::vector<std::string>& replicas);
   bool local_req_rsp(Memcached::BaseReq* req,
-                     Memcached::BaseRsp** rsp_ptr);
+                     Memcached::BaseRsp** rsp_ptr,
+                     bool reconnect = true);
+  bool local_conn_req_rsp(Memcached::BaseReq* req,
+                          Memcached::BaseRsp** rsp_ptr);
 
   pthread_mutex_t _lock;
   pthread_cond_t _cv;
@@ -175,6 +296,14 @@ private:
   pthread_t _control_thread_hdl;
   bool _terminated;
 
+  // The monitor thread, which watches for the local memcached restarting.
+  // These are atomic as they are used without holding the lock. The restart
+  // generation is incremented each time the monitor loses its connection to
+  // the local memcached.
+  pthread_t _monitor_thread_hdl;
+  std::atomic_bool _monitor_terminated;
+  std::atomic_uint_fast64_t _local_restart_generation;
+
   Updater<void, Astaire>* _sighup_updater;
   Updater<void, Astaire>* _sigusr1_updater;
 
@@ -189,6 +318,27 @@ private:
   AstairePerConnectionStatistics* _per_conn_stats;
 
   std::string _self;
+
+  // The address used to connect to the local memcached. This is either the
+  // same as `_self`, or the path of a Unix domain socket.
+  std::string _local_address;
+
+  // A connection to the local memcached, used for the control thread's
+  // requests and for writing checkpoints. This is protected by its own lock
+  // as resync workers use it while the control thread holds the main lock.
+  // The connection generation is the restart generation when the connection
+  // was made.
+  Memcached::ClientConnection* _local_conn;
+  uint64_t _local_conn_generation;
+  pthread_mutex_t _local_conn_lock;
+
+  // The maximum number of TAP connections to run against a single server at
+  // once.
+  int _tap_fanout;
+
+  RateLimiter* _tap_limiter;
+  RateLimiter* _inject_limiter;
+  LatencyController* _inject_controller;
 };
 
 #endif
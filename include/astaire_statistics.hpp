@@ -40,6 +40,7 @@
 #include "statrecorder.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <atomic>
 #include <stdint.h>
 
@@ -48,7 +49,8 @@
 // Gauge statistics hold values that count up and down and are reported
 // accurately (e.g. not gathered over a time period and analysed to make a
 // prepared value for reporting) hence we force a refresh whenever they are
-// changed.
+// changed. A refresh only marks the stats as changed - they are published by
+// the reporter thread on its next tick.
 #define GAUGE_STAT(NAME)                                                        \
   public:                                                                       \
     void increment_##NAME(uint32_t delta) { _##NAME.fetch_add(delta);           \
@@ -88,8 +90,10 @@ public:
   AstaireGlobalStatistics(LastValueCache* lvc,
                           uint_fast64_t period_us = DEFAULT_PERIOD_US) :
     StatRecorder(period_us),
+    _throttle_level(100),
     _refresh_mutex(PTHREAD_MUTEX_INITIALIZER),
     _terminated(false),
+    _dirty(true),
     _statistic("astaire_global", lvc)
   {
     pthread_condattr_t cond_attr;
@@ -139,17 +143,34 @@ public:
   COUNTER_STAT(resynced_bytes_count);
   COLLATED_STAT(bandwidth);
 
+  // Bytes of mutations received over TAP that were for vbuckets other than
+  // the ones being resynced, or for Astaire's own records.
+  COUNTER_STAT(discarded_bytes_count);
+
+  // Bytes of mutations that weren't injected because the local memcached
+  // already had the same or a newer record.
+  COUNTER_STAT(skipped_bytes_count);
+
+  // The rate resync records are being injected at, as a percentage of the
+  // configured limit. This isn't cleared by reset().
+  GAUGE_STAT(throttle_level);
+
 private:
   // Standard StatReporter API functions.
   void refresh(bool force);
   void refreshed();
   void read(uint_fast64_t period_us);
 
+  // Report the stats if they've changed since they were last reported. This
+  // is called on each tick of the reporter thread.
+  void publish();
+
   pthread_t _refresh_thread;
   pthread_cond_t _refresh_cond;
   pthread_mutex_t _refresh_mutex;
   bool _terminated;
   std::atomic_uint_fast64_t _timestamp_us;
+  std::atomic_bool _dirty;
   Statistic _statistic;
 };
 
@@ -160,20 +181,59 @@ public:
                                  uint_fast64_t period_us = DEFAULT_PERIOD_US) :
     StatRecorder(period_us),
     _lock(PTHREAD_MUTEX_INITIALIZER),
+    _terminated(false),
     _period_us(period_us),
+    _dirty(true),
     _statistic("astaire_connections", lvc)
   {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_refresh_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
     lock();
     reset();
     unlock();
+
+    int rc = pthread_create(&_refresh_thread,
+                            NULL,
+                            AstairePerConnectionStatistics::thread_func,
+                            this);
+    if (rc != 0)
+    {
+      TRC_ERROR("Stats reporter thread creation failed (%d)", rc);
+      TRC_ERROR("Per-bucket stats will not be reported");
+    }
   }
 
   virtual ~AstairePerConnectionStatistics()
   {
+    lock();
+    _terminated = true;
+    pthread_cond_signal(&_refresh_cond);
+    unlock();
+    pthread_join(_refresh_thread, NULL);
+
+    // Report the (empty) stats one last time, now the reporter has stopped.
     lock();
     reset();
+    refreshed();
     unlock();
+    pthread_cond_destroy(&_refresh_cond);
+  }
+
+  // Entry point to run the per-connection statistic reporting thread.  The
+  // `void*` argument must be a pointer to the owning
+  // AstairePerConnectionStatistics object.
+  static void* thread_func(void* arg)
+  {
+    AstairePerConnectionStatistics* conn_stats =
+      (AstairePerConnectionStatistics*)arg;
+    conn_stats->thread_func();
+    return NULL;
   }
+  void thread_func();
 
   // A record representing the stats for a single bucket.
   class ConnectionRecord;
@@ -203,6 +263,10 @@ public:
     // Write the stats for this BucketRecord to the given vector.
     void write_out(std::vector<std::string>& vec);
 
+    // Add keys and bytes that have been resynced, without causing the stats
+    // to be reported.
+    void add_resynced(uint32_t keys, uint32_t bytes);
+
     COUNTER_STAT(resynced_keys_count);
     COUNTER_STAT(resynced_bytes_count);
     COLLATED_STAT(bandwidth);
@@ -228,12 +292,19 @@ private:
       _period_us(period_us),
       _lock(lock)
     {
+      size_t num_slots = 0;
       for (std::vector<uint16_t>::const_iterator it = buckets.begin();
            it != buckets.end();
            ++it)
       {
         _bucket_map[*it] = new BucketRecord(this, *it, _period_us);
+        num_slots = std::max(num_slots, (size_t)*it + 1);
       }
+
+      _tap_keys = std::vector<std::atomic_uint_fast32_t>(num_slots);
+      _tap_bytes = std::vector<std::atomic_uint_fast32_t>(num_slots);
+      _folded_keys.assign(num_slots, 0);
+      _folded_bytes.assign(num_slots, 0);
       reset();
       set_total_buckets(buckets.size());
     };
@@ -285,6 +356,31 @@ private:
       return _bucket_map[bucket];
     }
 
+    // Record that a key in the given bucket has been resynced.
+    //
+    // This may only be called by the thread doing the TAP for this
+    // ConnectionRecord, and does not need the ConnectionRecord to be locked.
+    // The key will be reported once the reporter thread has folded it in.
+    void record_resynced_key(uint16_t bucket, uint32_t bytes)
+    {
+      if (bucket < _tap_keys.size())
+      {
+        // Only this thread writes these counters, so there's no need for an
+        // atomic read-modify-write.
+        _tap_keys[bucket].store(_tap_keys[bucket].load(std::memory_order_relaxed) + 1,
+                                std::memory_order_relaxed);
+        _tap_bytes[bucket].store(_tap_bytes[bucket].load(std::memory_order_relaxed) + bytes,
+                                 std::memory_order_relaxed);
+      }
+    }
+
+    // Fold the keys recorded by record_resynced_key into the BucketRecords.
+    //
+    // The ConnectionRecord must be locked to call this function.
+    //
+    // @returns - Whether any keys have been recorded since the last fold.
+    bool fold();
+
     // Lock or unlock this stats object and the parent stats object.  Locking
     // is required around most public functions.
     void lock() { pthread_mutex_lock(_lock); };
@@ -298,6 +394,14 @@ private:
     std::map<uint16_t, BucketRecord*> _bucket_map;
     uint_fast64_t _period_us;
     pthread_mutex_t* _lock;
+
+    // The number of keys and bytes resynced in each bucket (indexed by bucket
+    // ID), as written by the TAP thread. These only ever count up. The folded
+    // values are the values they had at the last fold.
+    std::vector<std::atomic_uint_fast32_t> _tap_keys;
+    std::vector<std::atomic_uint_fast32_t> _tap_bytes;
+    std::vector<uint32_t> _folded_keys;
+    std::vector<uint32_t> _folded_bytes;
   };
 
   // Create a new ConnectionRecord to represent a singe TAP connection.
@@ -321,10 +425,18 @@ private:
   void refreshed();
   void read(uint_fast64_t period_us);
 
+  // Report the stats if they've changed since they were last reported. This
+  // is called on each tick of the reporter thread, with the lock held.
+  void publish();
+
   pthread_mutex_t _lock;
+  pthread_t _refresh_thread;
+  pthread_cond_t _refresh_cond;
+  bool _terminated;
   uint_fast64_t _period_us;
   std::vector<ConnectionRecord*> _connections;
   std::atomic_uint_fast64_t _timestamp_us;
+  std::atomic_bool _dirty;
   Statistic _statistic;
 };
 
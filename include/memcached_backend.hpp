@@ -40,8 +40,12 @@
 
 #include <pthread.h>
 
+#include <atomic>
 #include <sstream>
 #include <vector>
+#include <map>
+#include <deque>
+#include <memory>
 
 extern "C" {
 #include <libmemcached/memcached.h>
@@ -56,15 +60,23 @@ extern "C" {
 #include "sasevent.h"
 #include "communicationmonitor.h"
 
+class Statistic;
+class LastValueCache;
 
 class MemcachedBackend
 {
 public:
   MemcachedBackend(MemcachedConfigReader* config_reader,
                    BaseCommunicationMonitor* comm_monitor = NULL,
-                   Alarm* vbucket_alarm = NULL);
+                   Alarm* vbucket_alarm = NULL,
+                   int connections_per_server = DEFAULT_CONNECTIONS_PER_SERVER,
+                   LastValueCache* lvc = NULL);
   ~MemcachedBackend();
 
+  /// The default number of connections the backend makes to each memcached
+  /// server.  These are shared between all the threads using the backend.
+  static const int DEFAULT_CONNECTIONS_PER_SERVER = 8;
+
   /// Flags that the store should use a new view of the memcached cluster to
   /// distribute data.  Note that this is public because it is called from
   /// the MemcachedStoreUpdater class and from UT classes.
@@ -74,11 +86,39 @@ public:
 
   void set_max_connect_latency(unsigned int ms);
 
+  /// Enables hedged reads.  If the first replica for a key hasn't answered
+  /// a read within the given percentile of its recent response times, the
+  /// read is sent to the next replica instead.  This must be called before
+  /// the backend is used.
+  ///
+  /// @param percentile        - The percentile of response times to wait
+  ///                            for before hedging.
+  /// @param max_hedge_percent - The most reads that may be hedged, as a
+  ///                            percentage of all reads.
+  void enable_hedged_reads(unsigned int percentile,
+                           unsigned int max_hedge_percent);
+
+  /// The default limit on the percentage of reads that are hedged.
+  static const int DEFAULT_MAX_HEDGE_PERCENT = 5;
+
   /// Gets the data for the specified key.
   Memcached::ResultCode read_data(const std::string& key,
                                   std::string& data,
                                   uint64_t& cas);
 
+  /// Gets the data for a set of keys.  Reads for keys that share a replica
+  /// are batched into a single request to that replica.
+  ///
+  /// @param keys   - The keys to read.
+  /// @param data   - (out) The data for each key, in the same order as `keys`.
+  /// @param cas    - (out) The CAS for each key, in the same order as `keys`.
+  /// @param status - (out) The result of each read, in the same order as
+  ///                 `keys`.
+  void read_data_multi(const std::vector<std::string>& keys,
+                       std::vector<std::string>& data,
+                       std::vector<uint64_t>& cas,
+                       std::vector<Memcached::ResultCode>& status);
+
   /// Sets the data for the specified key.
   Memcached::ResultCode write_data(Memcached::OpCode operation,
                                    const std::string& key,
@@ -93,31 +133,237 @@ public:
   void update_config();
 
 private:
-  // A copy of this structure is maintained for each worker thread, as
-  // thread local data.
-  typedef struct connection
+  // A bounded pool of connections to a single memcached server, shared by all
+  // the threads using the backend.  A memcached_st can only be used by one
+  // thread at a time, so a thread checks a connection out for the duration of
+  // a request and checks it back in afterwards.  Connections are created on
+  // demand (or when the pool is warmed) up to the pool's limit, after which
+  // threads wait for a connection to be checked in.
+  class ServerPool
   {
-    // Indicates the view number being used by this thread.  When the view
-    // changes the global view number is updated and each thread switches to
-    // the new view by establishing new memcached_st's.
-    uint64_t view_number;
+  public:
+    ServerPool(const std::string& server,
+               const std::string& options,
+               unsigned int connect_timeout_ms,
+               size_t max_connections);
+    ~ServerPool();
+
+    // Checks out a connection, waiting for one to become free if they are
+    // all in use.
+    memcached_st* checkout();
+
+    // Returns a connection obtained from checkout() to the pool.
+    void checkin(memcached_st* st);
+
+    // Connects every connection in the pool, so that the first requests
+    // routed to this server don't pay the cost of connecting.
+    void warm();
+
+    // Queues an unconditional write to this server.  The write is sent
+    // asynchronously by the pool's writer thread, batched with any other
+    // writes queued behind it.  If the queue is full, or the pool has no
+    // writer thread, the write is sent straight away instead.
+    void write_behind(const std::string& key,
+                      const std::string& data,
+                      int vbucket,
+                      int expiry,
+                      uint32_t flags);
+
+    // Discards any queued writes to the key, and waits for any write to it
+    // that is already being sent.  This must be called before sending a
+    // request for the key to the server directly, so that an older queued
+    // write can't overwrite it.
+    void cancel_writes(const std::string& key);
+
+    // Gets the state of the write-behind queue.
+    //
+    // @param queued     - (out) The number of writes waiting to be sent.
+    // @param lag_ms     - (out) How long the oldest unsent write has waited.
+    // @param overflowed - (out) The number of writes sent straight away
+    //                     because the queue was full.
+    // @param failed     - (out) The number of batches of writes that
+    //                     couldn't be sent.
+    void write_behind_state(size_t& queued,
+                            unsigned long& lag_ms,
+                            uint64_t& overflowed,
+                            uint64_t& failed);
+
+    // The state of the server's circuit breaker.  While the circuit is
+    // closed the server is used as normal.  Once FAILURE_THRESHOLD requests
+    // to it in a row have failed the circuit opens, and requests avoid the
+    // server where they can until a probe finds it has recovered.  The
+    // circuit is half-open while a probe is in progress.
+    enum CircuitState {CLOSED, OPEN, HALF_OPEN};
+    CircuitState circuit_state() const { return (CircuitState)_circuit_state.load(); }
+    bool healthy() const { return (circuit_state() == CLOSED); }
+
+    // Records the result of a request to the server, opening or closing the
+    // circuit as necessary.
+    void record_result(memcached_return_t rc);
+
+    // If the circuit is open, checks whether the server has recovered (on a
+    // new connection) and closes the circuit if it has.
+    void probe();
+
+    const std::string& server() const { return _server; }
+
+  private:
+    memcached_st* create_connection();
+
+    // Sends an unconditional write to the server without queueing it or
+    // waiting for a response.
+    void send_now(const std::string& key,
+                  const std::string& data,
+                  int vbucket,
+                  int expiry,
+                  uint32_t flags);
+
+    // A write waiting in the write-behind queue.
+    struct PendingWrite
+    {
+      std::string key;
+      std::string data;
+      int vbucket;
+      int expiry;
+      uint32_t flags;
+      unsigned long queued_ms;
+    };
+
+    // Entry point for the writer thread, which sends the queued writes.
+    static void* writer_thread_entry_point(void* pool_param);
+    void writer_thread_fn();
+
+    const std::string _server;
+    const std::string _options;
+    const unsigned int _connect_timeout_ms;
+    const size_t _max_connections;
+
+    // The number of connections created so far, and those not checked out.
+    size_t _num_connections;
+    std::vector<memcached_st*> _idle;
+
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+
+    // The write-behind queue, and the total size of the writes in it.  These
+    // (and the fields below) are protected by _write_lock.
+    std::deque<PendingWrite> _write_queue;
+    size_t _write_queue_bytes;
+
+    // The batch of writes being sent, and when the oldest write in it was
+    // queued (or zero if no batch is being sent).  The writer thread only
+    // changes these while holding _write_lock, and _write_done_cond is
+    // signalled when a batch has been sent.
+    std::vector<PendingWrite> _write_batch;
+    unsigned long _write_in_flight_ms;
+
+    // The number of writes sent straight away because the queue was full,
+    // and whether the queue was full for the last write.
+    uint64_t _writes_overflowed;
+    bool _queue_overflowing;
+
+    // The number of batches that couldn't be sent, and whether the last batch
+    // failed.
+    uint64_t _batches_failed;
+    bool _batches_failing;
+
+    // Whether the writer thread was started.  This doesn't change once the
+    // pool has been constructed.
+    bool _writer_started;
+
+    bool _terminated;
+    pthread_t _writer_thread;
+    pthread_mutex_t _write_lock;
+    pthread_cond_t _write_cond;
+    pthread_cond_t _write_done_cond;
+
+    // The circuit breaker's state, and the number of requests in a row that
+    // have failed.
+    std::atomic_int _circuit_state;
+    std::atomic_uint _consecutive_failures;
+    static const unsigned int FAILURE_THRESHOLD = 5;
+
+    // The most data that may be queued for a server, and the most writes
+    // that are sent in a single batch.
+    static const size_t MAX_WRITE_BEHIND_BYTES = 64 * 1024 * 1024;
+    static const size_t MAX_WRITE_BEHIND_BATCH = 256;
+  };
+
+  // A view of the memcached cluster, as used by the worker threads.  Threads
+  // take a reference to the current view for the duration of each request, so
+  // a view (and its connections) stays alive until the last request using it
+  // has finished, even if a new view has been installed in the meantime.
+  struct View
+  {
+    // The connection pool for each server.  A server's pool is shared by all
+    // the views that include that server, so its connections survive changes
+    // to the rest of the cluster.
+    std::map<std::string, std::shared_ptr<ServerPool> > pools;
+
+    // The set of read and write replicas for each vbucket.
+    std::vector<std::vector<ServerPool*> > read_replicas;
+    std::vector<std::vector<ServerPool*> > write_replicas;
+  };
+
+  // Returns the current view.
+  std::shared_ptr<View> current_view();
+
+  // Returns a set of replicas in the order they should be tried, with any
+  // whose circuit isn't closed moved to the end.  This is `replicas` itself
+  // if they are all healthy, and otherwise `reordered`.
+  static const std::vector<ServerPool*>&
+    healthy_first(const std::vector<ServerPool*>& replicas,
+                  std::vector<ServerPool*>& reordered);
+
+  // Decides how long reads should wait for their first replica before they
+  // are hedged, based on the response times of the reads in the previous
+  // second, and limits the proportion of reads that are hedged.
+  class HedgePolicy
+  {
+  public:
+    HedgePolicy(unsigned int percentile,
+                unsigned int max_hedge_percent,
+                unsigned int max_delay_ms);
+    ~HedgePolicy();
+
+    // Returns how long a read should wait for its first replica before it is
+    // hedged, in milliseconds, or zero if it shouldn't be hedged.
+    unsigned int hedge_delay_ms();
 
-    // Contains the memcached_st's for each server.
-    std::map<std::string, memcached_st*> st;
+    // Records the response time of a read from a first replica, and whether
+    // the read was hedged.
+    void record_read(uint64_t latency_us, bool hedged);
 
-    // Contains the set of read and write replicas for each vbucket.
-    std::vector<std::vector<memcached_st*> > write_replicas;
-    std::vector<std::vector<memcached_st*> > read_replicas;
+  private:
+    static const uint64_t PERIOD_US = 1000000;
 
-  } connection;
+    const unsigned int _percentile;
+    const unsigned int _max_hedge_percent;
+    const unsigned int _max_delay_ms;
+
+    pthread_mutex_t _lock;
+
+    // The delay worked out from the last period's response times, or zero if
+    // there weren't any.
+    unsigned int _delay_ms;
+
+    // The response times recorded, and reads hedged, in the current period.
+    std::vector<uint64_t> _latencies;
+    uint64_t _hedges;
+    struct timespec _period_start;
+  };
 
   /// Returns the vbucket for a specified key.
   int vbucket_for_key(const std::string& key);
 
   /// Gets the set of connections to use for a read or write operation.
   typedef enum {READ, WRITE} Op;
-  const std::vector<memcached_st*>& get_replicas(const std::string& key, Op operation);
-  const std::vector<memcached_st*>& get_replicas(int vbucket, Op operation);
+  const std::vector<ServerPool*>& get_replicas(const View& view,
+                                               const std::string& key,
+                                               Op operation);
+  const std::vector<ServerPool*>& get_replicas(const View& view,
+                                               int vbucket,
+                                               Op operation);
 
   /// Used to set the communication state for a vbucket after a get/set.
   typedef enum {OK, FAILED} CommState;
@@ -125,13 +371,10 @@ private:
 
   // Stores time for the next vbucket alarm update. Start at 0 to ensure first update is sent
   unsigned long _next_vbucket_alarm_update = 0;
-  unsigned long current_time_ms();
+  static unsigned long current_time_ms();
   // Only send alarm updates if 30 seconds have passed since last update
   unsigned int _update_period_ms = 30 * 1000;
 
-  // Called by the thread-local-storage clean-up functions when a thread ends.
-  static void cleanup_connection(void* p);
-
   // Perform a get request to a single replica.
   memcached_return_t get_from_replica(memcached_st* replica,
                                       const char* key_ptr,
@@ -139,6 +382,35 @@ private:
                                       std::string& data,
                                       uint64_t& cas);
 
+  // Perform a get request for a set of keys to a single replica.
+  //
+  // @param rcs - (out) The result for each key. Keys that are not found are
+  //              set to MEMCACHED_NOTFOUND.
+  // @return    - The overall result of the request. If this is an error, any
+  //              keys that hadn't already been read are set to this error.
+  memcached_return_t get_multi_from_replica(memcached_st* replica,
+                                            const std::vector<const char*>& key_ptrs,
+                                            const std::vector<size_t>& key_lens,
+                                            std::vector<std::string>& data,
+                                            std::vector<uint64_t>& cas,
+                                            std::vector<memcached_return_t>& rcs);
+
+  // Work out the result of a read once all the replicas have been tried, and
+  // update the communication state accordingly.
+  //
+  // @param rc               - The result from the last replica tried.
+  // @param active_not_found - Whether an earlier replica returned NOT_FOUND.
+  // @param failed_replicas  - The number of replicas that returned an error.
+  // @param cas              - (in/out) The CAS value read.
+  Memcached::ResultCode complete_read(const std::string& key,
+                                      int vbucket,
+                                      size_t num_replicas,
+                                      memcached_return_t rc,
+                                      bool active_not_found,
+                                      size_t failed_replicas,
+                                      std::string& data,
+                                      uint64_t& cas);
+
   // Utility function to turn a return code from libmemcached back into a status
   // code that can be used in the binary protocol.
   //
@@ -156,9 +428,6 @@ private:
   // Stores a pointer to an updater object
   Updater<void, MemcachedBackend>* _updater;
 
-  // Used to store a connection structure for each worker thread.
-  pthread_key_t _thread_local;
-
   // Stores the number of replicas configured for the store (one means the
   // data is stored on one server, two means it is stored on two servers etc.).
   const int _replicas;
@@ -172,26 +441,29 @@ private:
   // current view.
   std::string _options;
 
-  // The current global view number.  Note that this is not protected by the
-  // _view_lock.
-  uint64_t _view_number;
+  // The maximum number of connections to make to each server.
+  const size_t _connections_per_server;
 
-  // The lock used to protect the view parameters below (_servers,
-  // _read_replicas and _write_replicas).
+  // The lock used to protect the view parameters below (_servers and _view).
   pthread_rwlock_t _view_lock;
 
   // The list of servers in this view.
   std::vector<std::string> _servers;
 
+  // The current view.
+  std::shared_ptr<View> _view;
+
+  // The time to wait for a response from memcached.
+  static const unsigned int POLL_TIMEOUT_MS = 250;
+
+  // The policy for hedging reads, or NULL if reads aren't hedged.
+  HedgePolicy* _hedge_policy;
+
   // The time to wait before timing out a connection to memcached.
   // (This is only used during normal running - at start-of-day we use
   // a fixed 10ms time, to start up as quickly as possible).
   unsigned int _max_connect_latency_ms;
 
-  // The set of read and write replicas for each vbucket.
-  std::vector<std::vector<std::string> > _read_replicas;
-  std::vector<std::vector<std::string> > _write_replicas;
-
   // The maximum expiration delta that memcached expects.  Any expiration
   // value larger than this is assumed to be an absolute rather than relative
   // value.  This matches the REALTIME_MAXDELTA constant defined by memcached.
@@ -217,6 +489,30 @@ private:
 
   // Object used to read the memcached config.
   MemcachedConfigReader* _config_reader;
+
+  // Entry point for the thread that reports the state of each server's
+  // write-behind queue.
+  static void* stats_thread_entry_point(void* backend_param);
+  void stats_thread_fn();
+
+  // The statistic the write-behind state is reported in, or NULL if it isn't
+  // reported, and the values last reported.
+  Statistic* _replica_statistic;
+  std::vector<std::string> _replica_stats;
+
+  bool _stats_terminated;
+  pthread_t _stats_thread;
+  pthread_mutex_t _stats_lock;
+  pthread_cond_t _stats_cond;
+
+  // Entry point for the thread that probes servers whose circuit is open.
+  static void* prober_thread_entry_point(void* backend_param);
+  void prober_thread_fn();
+
+  bool _prober_terminated;
+  pthread_t _prober_thread;
+  pthread_mutex_t _prober_lock;
+  pthread_cond_t _prober_cond;
 };
 
 #endif
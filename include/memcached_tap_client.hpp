@@ -40,7 +40,9 @@
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <cstring>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <boost/detail/endian.hpp>
 #include <log.h>
 
@@ -75,6 +77,14 @@ namespace Memcached
     }
     inline uint64_t network_to_host(uint64_t v) { return host_to_network(v); }
 
+    // Read a value in network byte order from a (possibly unaligned) buffer.
+    template<class T> T read(const char* raw)
+    {
+      T network_value;
+      memcpy(&network_value, raw, sizeof(T));
+      return network_to_host(network_value);
+    }
+
     void write(const std::string& value, std::string& str);
     template<class T> void write(const T& value, std::string& str)
     {
@@ -90,13 +100,26 @@ namespace Memcached
     ADD = 0x02,
     REPLACE = 0x03,
     DELETE = 0x04,
+    GETQ = 0x09,
+    NOOP = 0x0a,
     VERSION = 0x0b,
     GETK = 0x0c,
+    GETKQ = 0x0d,
+    SETQ = 0x11,
+    ADDQ = 0x12,
+    REPLACEQ = 0x13,
+    DELETEQ = 0x14,
     TAP_CONNECT = 0x40,
     TAP_MUTATE = 0x41,
     SET_VBUCKET = 0x3d
   };
 
+  // Utilities for the quiet variants of commands. A quiet command behaves
+  // exactly like the corresponding normal command, except that no response is
+  // sent in the common case (a miss for GETQ/GETKQ, success for the others).
+  bool is_quiet(uint8_t op_code);
+  uint8_t unquiet(uint8_t op_code);
+
   enum struct ResultCode
   {
     NO_ERROR = 0X0000,
@@ -146,6 +169,44 @@ namespace Memcached
     uint64_t cas;
   };
 
+  /* A view of a complete message sitting in a receive buffer.
+   *
+   * This allows the fields of a message to be examined without copying them
+   * out of the buffer. The view does not own the data, so it is only valid
+   * until the buffer is next modified. */
+  class MsgView
+  {
+  public:
+    MsgView() : _data(NULL), _length(0) {}
+    MsgView(const char* data, size_t length) : _data(data), _length(length) {}
+
+    // The whole message, as it appeared on the wire.
+    const char* data() const { return _data; }
+    size_t length() const { return _length; }
+    bool empty() const { return (_data == NULL); }
+
+    bool is_request() const { return ((uint8_t)_data[0] == 0x80); }
+    uint8_t op_code() const { return HDR_GET(_data, op_code); }
+    uint16_t vbucket_or_status() const { return HDR_GET(_data, vbucket_or_status); }
+    uint32_t opaque() const { return HDR_GET(_data, opaque); }
+    uint64_t cas() const { return HDR_GET(_data, cas); }
+
+    // The variable length sections of the message.
+    uint8_t extra_length() const { return HDR_GET(_data, extra_length); }
+    uint16_t key_length() const { return HDR_GET(_data, key_length); }
+    uint32_t value_length() const
+    {
+      return HDR_GET(_data, body_length) - (extra_length() + key_length());
+    }
+    const char* extra() const { return _data + sizeof(MsgHdr); }
+    const char* key() const { return extra() + extra_length(); }
+    const char* value() const { return key() + key_length(); }
+
+  private:
+    const char* _data;
+    size_t _length;
+  };
+
   /* This abstract base class represents a generic Memcached message.
    *
    * This class is mostly used for defining common utilities and specifying a
@@ -160,7 +221,7 @@ namespace Memcached
       _cas(cas)
     {
     }
-    BaseMessage(const std::string& msg);
+    BaseMessage(const MsgView& msg);
     virtual ~BaseMessage() {};
 
     virtual bool is_request() const = 0;
@@ -170,11 +231,23 @@ namespace Memcached
     inline uint32_t opaque() const { return _opaque; };
     inline uint64_t cas() const { return _cas; };
 
+    // Serialize the message into a newly allocated string.
     std::string to_wire() const;
 
+    // Serialize the header, extras and key of the message onto the end of
+    // `ss`. The value is returned rather than copied, so that it can be sent
+    // straight from the message with scatter-gather I/O.
+    const std::string& to_wire(std::string& ss) const;
+
+    // The length of the serialized message (including the value).
+    size_t wire_length() const;
+
   protected:
-    virtual std::string generate_extra() const{ return ""; };
-    virtual std::string generate_value() const { return ""; };
+    // The extras section. `generate_extra` must append exactly
+    // `extra_length` bytes.
+    virtual uint8_t extra_length() const { return 0; };
+    virtual void generate_extra(std::string& ss) const {};
+    virtual const std::string& generate_value() const;
     virtual uint16_t generate_vbucket_or_status() const = 0;
 
     uint8_t _op_code;
@@ -195,7 +268,7 @@ namespace Memcached
       _vbucket(vbucket)
     {
     }
-    BaseReq(const std::string& msg);
+    BaseReq(const MsgView& msg);
 
     bool is_request() const { return true; }
     bool is_response() const { return false; }
@@ -219,7 +292,7 @@ namespace Memcached
       _status(status)
     {
     }
-    BaseRsp(const std::string& msg);
+    BaseRsp(const MsgView& msg);
 
     bool is_request() const { return false; }
     bool is_response() const { return true; }
@@ -234,13 +307,15 @@ namespace Memcached
   class GetReq : public BaseReq
   {
   public:
-    GetReq(const std::string& msg) : BaseReq(msg) {}
+    GetReq(const MsgView& msg) : BaseReq(msg) {}
 
     // This constructor explicitly takes an opaque parameter to distinguish it
     // from the previous constructor (which initializes a GET request from a
     // message buffer).
-    GetReq(std::string key, uint32_t opaque) :
-      BaseReq((uint8_t)OpCode::GET, key, 0, opaque, 0)
+    GetReq(std::string key,
+           uint32_t opaque,
+           uint8_t command = (uint8_t)OpCode::GET) :
+      BaseReq(command, key, 0, opaque, 0)
     {}
 
     bool response_needs_key() const;
@@ -249,20 +324,22 @@ namespace Memcached
   class GetRsp : public BaseRsp
   {
   public:
-    GetRsp(const std::string& msg);
+    GetRsp(const MsgView& msg);
     GetRsp(uint16_t status,
            uint32_t opaque,
            uint64_t cas,
            const std::string& value,
            uint32_t flags,
-           const std::string& key = "");
+           const std::string& key = "",
+           uint8_t op_code = (uint8_t)OpCode::GET);
 
-    std::string value() const { return _value; };
+    const std::string& value() const { return _value; };
     uint32_t flags() const { return _flags; };
 
   private:
-    virtual std::string generate_extra() const;
-    virtual std::string generate_value() const;
+    virtual uint8_t extra_length() const;
+    virtual void generate_extra(std::string& ss) const;
+    virtual const std::string& generate_value() const { return _value; };
 
     std::string _value;
     uint32_t _flags;
@@ -271,43 +348,69 @@ namespace Memcached
   class DeleteReq : public BaseReq
   {
   public:
-    DeleteReq(const std::string& msg) : BaseReq(msg) {}
+    DeleteReq(const MsgView& msg) : BaseReq(msg) {}
 
     // This constructor explicitly takes an opaque parameter to distinguish it
     // from the previous constructor (which initializes a GET request from a
     // message buffer).
-    DeleteReq(std::string key, uint32_t opaque) :
-      BaseReq((uint8_t)OpCode::DELETE, key, 0, opaque, 0)
+    DeleteReq(std::string key,
+              uint32_t opaque,
+              uint8_t command = (uint8_t)OpCode::DELETE) :
+      BaseReq(command, key, 0, opaque, 0)
     {}
   };
 
   class DeleteRsp : public BaseRsp
   {
   public:
-    DeleteRsp(const std::string& msg);
-    DeleteRsp(uint8_t status, uint32_t opaque) :
-      BaseRsp((uint8_t)OpCode::DELETE, "", status, opaque, 0)
+    DeleteRsp(const MsgView& msg) : BaseRsp(msg) {}
+    DeleteRsp(uint8_t status,
+              uint32_t opaque,
+              uint8_t command = (uint8_t)OpCode::DELETE) :
+      BaseRsp(command, "", status, opaque, 0)
+    {}
+  };
+
+  class NoopReq : public BaseReq
+  {
+  public:
+    NoopReq(const MsgView& msg) : BaseReq(msg) {}
+
+    NoopReq(uint32_t opaque) :
+      BaseReq((uint8_t)OpCode::NOOP, "", 0, opaque, 0)
+    {}
+  };
+
+  class NoopRsp : public BaseRsp
+  {
+  public:
+    NoopRsp(const MsgView& msg) : BaseRsp(msg) {}
+
+    NoopRsp(uint32_t opaque) :
+      BaseRsp((uint8_t)OpCode::NOOP, "", (uint16_t)ResultCode::NO_ERROR, opaque, 0)
     {}
   };
 
   class SetAddReplaceReq : public BaseReq
   {
   public:
-    SetAddReplaceReq(const std::string& msg);
+    SetAddReplaceReq(const MsgView& msg);
     SetAddReplaceReq(uint8_t command,
                      std::string key,
                      uint16_t vbucket,
                      std::string value,
                      uint64_t cas,
                      uint32_t flags,
-                     uint32_t expiry);
+                     uint32_t expiry,
+                     uint32_t opaque = 0);
 
     uint32_t expiry() const { return _expiry; }
-    std::string value() const { return _value; }
+    const std::string& value() const { return _value; }
 
   protected:
-    std::string generate_extra() const;
-    std::string generate_value() const;
+    uint8_t extra_length() const { return 2 * sizeof(uint32_t); }
+    void generate_extra(std::string& ss) const;
+    const std::string& generate_value() const { return _value; }
 
   private:
     std::string _value;
@@ -318,7 +421,7 @@ namespace Memcached
   class SetAddReplaceRsp : public BaseRsp
   {
   public:
-    SetAddReplaceRsp(const std::string& msg) : BaseRsp(msg) {};
+    SetAddReplaceRsp(const MsgView& msg) : BaseRsp(msg) {};
 
     SetAddReplaceRsp(uint8_t command,
                      uint8_t status,
@@ -331,7 +434,7 @@ namespace Memcached
   class SetReq : public SetAddReplaceReq
   {
   public:
-    SetReq(const std::string& msg) : SetAddReplaceReq(msg) {}
+    SetReq(const MsgView& msg) : SetAddReplaceReq(msg) {}
 
     SetReq(std::string key,
            uint16_t vbucket,
@@ -347,7 +450,7 @@ namespace Memcached
   class AddReq : public SetAddReplaceReq
   {
   public:
-    AddReq(const std::string& msg): SetAddReplaceReq(msg) {}
+    AddReq(const MsgView& msg): SetAddReplaceReq(msg) {}
 
     AddReq(std::string key,
            uint16_t vbucket,
@@ -363,7 +466,7 @@ namespace Memcached
   class ReplaceReq : public SetAddReplaceReq
   {
   public:
-    ReplaceReq(const std::string& msg): SetAddReplaceReq(msg) {}
+    ReplaceReq(const MsgView& msg): SetAddReplaceReq(msg) {}
 
     ReplaceReq(std::string key,
                uint16_t vbucket,
@@ -383,17 +486,21 @@ namespace Memcached
     TapConnectReq(const VBucketList& buckets);
 
   protected:
-    std::string generate_extra() const;
-    std::string generate_value() const;
+    uint8_t extra_length() const { return sizeof(uint32_t); }
+    void generate_extra(std::string& ss) const;
+    const std::string& generate_value() const { return _value; }
 
   private:
     std::vector<uint16_t> _buckets;
+
+    // The list of buckets, as it appears in the value.
+    std::string _value;
   };
 
   class VersionReq : public BaseReq
   {
   public:
-    VersionReq(const std::string& msg) : BaseReq(msg) {}
+    VersionReq(const MsgView& msg) : BaseReq(msg) {}
   };
 
   class VersionRsp : public BaseRsp
@@ -403,7 +510,7 @@ namespace Memcached
                uint32_t opaque,
                const std::string& version);
 
-    std::string generate_value() const;
+    const std::string& generate_value() const { return _version; }
 
   private:
     std::string _version;
@@ -412,9 +519,9 @@ namespace Memcached
   class TapMutateReq : public BaseReq
   {
   public:
-    TapMutateReq(const std::string& msg);
+    TapMutateReq(const MsgView& msg);
 
-    std::string value() const { return _value; };
+    const std::string& value() const { return _value; };
     uint32_t flags() const { return _flags; };
     uint32_t expiry() const { return _expiry; };
 
@@ -437,7 +544,8 @@ namespace Memcached
     {
     }
 
-    std::string generate_extra() const;
+    uint8_t extra_length() const { return sizeof(uint32_t); }
+    void generate_extra(std::string& ss) const;
 
   private:
     VBucketStatus _status;
@@ -451,45 +559,148 @@ namespace Memcached
     bool send(const BaseMessage& msg);
     Status recv(BaseMessage** msg);
 
+    // Send a batch of messages with as few system calls as possible.
+    bool send(const std::vector<const BaseMessage*>& msgs);
+
+    // Receive the next message without parsing it into a message object.
+    // The view points into the receive buffer, so is only valid until the
+    // next call to receive on this connection.
+    Status recv(MsgView& view);
+
+    // As `recv`, but only returns a message that has already been received,
+    // without waiting for more data. `view` is left empty if there isn't
+    // one.
+    Status recv_buffered(MsgView& view);
+
     std::string address() { return _address; }
 
+    // Set the size of the largest value that will be accepted off the wire,
+    // on all connections. A message with a larger value is treated as a
+    // protocol error, as is one whose length fields are inconsistent.
+    static void set_max_item_size(uint32_t max_item_size);
+
+    // The default maximum item size, which matches memcached's own default.
+    static const uint32_t DEFAULT_MAX_ITEM_SIZE = 1024 * 1024;
+
   protected:
     Connection();
     virtual ~Connection();
 
+    // Take the next complete message off the receive buffer.
+    //
+    // @returns  ERROR if the next message can't be accepted, otherwise OK.
+    //           `view` is left empty if more data is needed.
+    Status next_view(MsgView& view);
+
+    // Send the data described by an array of iovecs, blocking until it has
+    // all been sent. Closes the socket on failure.
+    bool send_iov(struct iovec* iov, size_t iovcnt);
+
+    // Check that the header of a message is one we're prepared to accept:
+    // its length fields are consistent and its value isn't too large.
+    bool header_acceptable(const char* raw);
+
+    // Read whatever is available on the socket into the receive buffer.
+    //
+    // @returns  The result of the underlying recv call, or -1 (with errno
+    //           set to EPROTO) if the message being received can't be
+    //           accepted.
+    ssize_t recv_into_buffer();
+
     std::string _address;
     int _sock;
+
+    // Scratch space for serializing message headers, kept between sends so
+    // that it doesn't need reallocating for each message.
+    std::string _header_buffer;
+
+    // The receive buffer, and the offset of the first byte in it that hasn't
+    // been parsed yet. Parsed messages are only removed from the buffer when
+    // more data is added, so that parsing a run of messages never has to
+    // shuffle the remainder of the buffer down.
     std::string _buffer;
+    size_t _buffer_offset;
+
+    // Bounce buffer used to receive the rest of large messages.  This is only
+    // allocated once a large message is received.
+    std::vector<char> _large_recv_buffer;
+
+    static uint32_t _max_item_size;
   };
 
   class ClientConnection : public Connection
   {
   public:
+    // @param address - Either a host and port, or the path of a Unix domain
+    //                  socket (which must start with a '/').
     ClientConnection(const std::string& address);
     int connect();
+
+    bool connected() const { return _sock >= 0; }
+    int sock() const { return _sock; }
   };
 
   class ServerConnection : public Connection
   {
   public:
     ServerConnection(int sock, const std::string& address);
+
+    int sock() const { return _sock; }
+
+    // The following functions make up a non-blocking API, for use when the
+    // socket has been put into non-blocking mode and is being driven by an
+    // event loop.  Unlike the blocking API they do not close the socket on
+    // failure - that is left to the owner of the connection.
+
+    // Read all the data that is currently available on the socket into the
+    // receive buffer.
+    //
+    // @returns OK if the socket is still usable (even if no data was read).
+    Status recv_available();
+
+    // Parse the next complete message out of the receive buffer.
+    //
+    // @returns  ERROR if the next message can't be accepted, otherwise OK.
+    //           `msg` is set to NULL if more data is needed.
+    Status next_msg(BaseMessage** msg);
+
+    // Send a message. As much of the message as the socket will accept is
+    // written immediately (without copying the value), and the rest is
+    // queued to be written by `flush`. If data is already queued, the whole
+    // message is queued behind it.
+    //
+    // @returns OK if the socket is still usable (even if some data remains
+    //          queued).
+    Status write(const BaseMessage& msg);
+
+    // Write as much queued data as the socket will currently accept.
+    //
+    // @returns OK if the socket is still usable (even if some data remains
+    //          queued).
+    Status flush();
+
+    bool send_pending() const { return !_send_buffer.empty(); }
+
+  private:
+    std::string _send_buffer;
   };
 
   // Entry point for parsing messages off the wire.
   //
-  // @returns  True if the string contains a complete message.
-  // @param binary - The message off the wire.  If the message is
-  //                 complete, it is removed from the front of the string
-  //                 before this function returns.
-  // @param output - A pointer to store the parsed message.
-  bool from_wire(std::string& binary, BaseMessage*& output);
+  // @returns  The parsed message. The caller takes ownership.
+  // @param msg - A view of a complete message off the wire.
+  BaseMessage* from_wire(const MsgView& msg);
 
   // Parsing utility fuctions.
-  bool is_msg_complete(const std::string& msg,
-                       bool& request,
-                       uint16_t& body_length,
-                       uint8_t& op_code);
-  template <class T> BaseMessage* from_wire_int(const std::string& msg)
+  //
+  // @returns  True if the buffer starts with a complete message.
+  // @param length - (out) The length of the message, including the header,
+  //                 if the buffer holds at least the whole header (even if
+  //                 the message isn't complete).  Otherwise zero.
+  bool is_msg_complete(const char* raw,
+                       size_t raw_length,
+                       size_t& length);
+  template <class T> BaseMessage* from_wire_int(const MsgView& msg)
   {
     return new T(msg);
   }
@@ -37,12 +37,28 @@
 #ifndef PROXY_SERVER_HPP__
 #define PROXY_SERVER_HPP__
 
+#include <atomic>
+#include <deque>
+#include <set>
+#include <vector>
+
 #include "memcached_backend.hpp"
 
 class ProxyServer
 {
 public:
-  ProxyServer(MemcachedBackend* backend);
+  /// Constructor.
+  ///
+  /// @param backend            - The backend used to access the memcached
+  ///                             cluster.
+  /// @param num_io_threads     - The number of threads to use to service
+  ///                             client connections. If zero, one thread is
+  ///                             used per CPU core.
+  /// @param num_worker_threads - The number of threads to use to make
+  ///                             requests to the backend.
+  ProxyServer(MemcachedBackend* backend,
+              int num_io_threads = 0,
+              int num_worker_threads = DEFAULT_WORKER_THREADS);
   virtual ~ProxyServer();
 
   /// Start the proxy server.
@@ -50,47 +66,175 @@ public:
   /// @return - Whether the server started successfully or not.
   bool start(const char* bind_addr);
 
+  /// The default number of worker threads. Each worker has at most one
+  /// backend request in flight, so this caps the number of requests the
+  /// proxy has outstanding to the cluster at any one time.
+  static const int DEFAULT_WORKER_THREADS = 64;
+
 private:
   /// Entry points for the listener thread.
   static void* listen_thread_entry_point(void* server_param);
   void listen_thread_fn();
 
-  /// Entry points for the per-connection threads.
-  struct ConnectionThreadParams
+  /// Each I/O thread runs an epoll loop that multiplexes a subset of the
+  /// client connections.  Connections are assigned to I/O threads
+  /// round-robin as they are accepted.  The I/O thread reads and parses all
+  /// requests on its connections, and hands requests that need to go to the
+  /// backend to the worker threads.
+  struct IOThread
   {
     ProxyServer* server;
+    int epoll_fd;
+    pthread_t thread;
+  };
+  static void* io_thread_entry_point(void* params);
+  void io_thread_fn(IOThread* io_thread);
+
+  /// State held about each client connection.
+  ///
+  /// The receive side of the connection is only ever touched by the owning
+  /// I/O thread.  The send side, and the rest of the state below, is shared
+  /// with the worker threads and is protected by `lock`.
+  struct Client
+  {
+    Client(Memcached::ServerConnection* connection, IOThread* io_thread);
+    ~Client();
+
     Memcached::ServerConnection* connection;
+    IOThread* io_thread;
+    pthread_mutex_t lock;
+
+    /// The number of references to this object. The I/O thread holds one
+    /// reference until the connection is closed, and each outstanding
+    /// request holds another. The socket is not closed until the last
+    /// reference is released, so its file descriptor can't be reused while
+    /// a worker might still be writing to it.
+    std::atomic_int refs;
+
+    /// Requests on a connection are numbered in the order they are
+    /// received. This is the sequence number of the next request, and is
+    /// only accessed by the I/O thread.
+    uint64_t next_seq;
+
+    /// The sequence numbers of the requests that have been handed to the
+    /// workers and not yet completed.
+    std::set<uint64_t> outstanding;
+
+    /// NOOPs that are waiting for earlier requests to complete before they
+    /// can be responded to, as (sequence number, opaque) pairs.  A NOOP
+    /// response tells the client that it has had all the responses it is
+    /// going to get to its earlier (quiet) requests.
+    std::deque<std::pair<uint64_t, uint32_t>> pending_noops;
+
+    /// Whether the I/O thread has stopped parsing requests off this
+    /// connection because it has too many outstanding.
+    bool read_paused;
+
+    /// Whether the I/O thread has closed this connection.
+    bool closed;
+
+    /// The events this connection is currently registered with epoll for.
+    uint32_t registered_events;
   };
-  static void* connection_thread_entry_point(void* params);
-  void connection_thread_fn(Memcached::ServerConnection* connection);
 
-  /// Handle a GET request from the client and send an appropriate response.
+  /// Handle an epoll event on a client connection.
+  ///
+  /// @return - Whether the connection should be kept open.
+  bool handle_client_event(Client* client, uint32_t events);
+
+  /// Tear down a client connection. Must be called on the owning I/O thread.
+  void close_client(Client* client);
+
+  /// Release a reference to a client, deleting it if it was the last one.
+  static void release_client(Client* client);
+
+  /// Update the events a connection is registered with epoll for, based on
+  /// its current state.  The client's lock must be held.
+  ///
+  /// @return - Whether the registration was updated successfully.
+  bool update_epoll_events(Client* client);
+
+  /// A batch of requests from one client that has been passed to the worker
+  /// threads. The batch owns the messages and a reference to the client.
+  ///
+  /// Most requests are passed to the workers on their own, but consecutive
+  /// GETs are batched up so that the backend can read them with a single
+  /// request to each server.
+  struct Request
+  {
+    Client* client;
+    std::vector<uint64_t> seqs;
+    std::vector<Memcached::BaseReq*> msgs;
+  };
+
+  /// Handle a single request from a client, either responding to it
+  /// directly or passing it to the worker threads.  Takes ownership of the
+  /// message.
+  ///
+  /// @param get_batch - The GETs that have been received but not yet passed
+  ///                    to the workers. GETs are added to this rather than
+  ///                    being passed on immediately.
+  /// @return          - Whether the connection should be kept open.
+  bool dispatch_request(Client* client,
+                        Memcached::BaseMessage* msg,
+                        Request& get_batch);
+
+  /// Pass a batch of requests to the worker threads, leaving the batch
+  /// empty. Does nothing if the batch is already empty.
+  void queue_request(Client* client, Request& request);
+
+  /// Queue a response on a client connection and try to send it. The
+  /// client's lock must be held.
+  void send_response(Client* client, const Memcached::BaseMessage& rsp);
+
+  /// Respond to any NOOPs that are no longer waiting for earlier requests
+  /// to complete. The client's lock must be held.
+  void send_ready_noops(Client* client);
+
+  /// Whether the response to a request should be suppressed because the
+  /// request was quiet and the response is not interesting.
+  static bool suppress_response(const Memcached::BaseReq* req,
+                                const Memcached::BaseRsp* rsp);
+
+  /// Entry points for the worker threads.
+  static void* worker_thread_entry_point(void* server_param);
+  void worker_thread_fn();
+
+  /// Make a request to the backend.
+  ///
+  /// @return - The response to send to the client. The caller takes
+  ///           ownership.
+  Memcached::BaseRsp* process_request(Memcached::BaseReq* req);
+
+  /// Handle a GET request from the client.
   ///
   /// @param get_req    - The received request. This function does not take
   ///                     ownership.
-  /// @param connection - The connection the request was received one and
-  ///                     should be used for sending a response.
-  void handle_get(Memcached::GetReq* get_req,
-                  Memcached::ServerConnection* connection);
+  /// @return           - The response to send to the client.
+  Memcached::BaseRsp* handle_get(Memcached::GetReq* get_req);
 
-  /// Handle a SET/ADD/REPLACE request from the client and send an appropriate
-  /// response.
+  /// Handle a batch of GET requests from the client.
+  ///
+  /// @param get_reqs   - The received requests. This function does not take
+  ///                     ownership.
+  /// @param rsps       - (out) The responses to send to the client, in the
+  ///                     same order as the requests.
+  void handle_get_batch(const std::vector<Memcached::BaseReq*>& get_reqs,
+                        std::vector<Memcached::BaseRsp*>& rsps);
+
+  /// Handle a SET/ADD/REPLACE request from the client.
   ///
   /// @param sar_req    - The received request. This function does not take
   ///                     ownership.
-  /// @param connection - The connection the request was received one and
-  ///                     should be used for sending a response.
-  void handle_set_add_replace(Memcached::SetAddReplaceReq* sar_req,
-                              Memcached::ServerConnection* connection);
+  /// @return           - The response to send to the client.
+  Memcached::BaseRsp* handle_set_add_replace(Memcached::SetAddReplaceReq* sar_req);
 
-  /// Handle a DELETE request from the client and send an appropriate response.
+  /// Handle a DELETE request from the client.
   ///
   /// @param delete_req - The received request. This function does not take
   ///                     ownership.
-  /// @param connection - The connection the request was received one and
-  ///                     should be used for sending a response.
-  void handle_delete(Memcached::DeleteReq* delete_req,
-                     Memcached::ServerConnection* connection);
+  /// @return           - The response to send to the client.
+  Memcached::BaseRsp* handle_delete(Memcached::DeleteReq* delete_req);
 
 
   /// Socket on which the server listens for new connections.
@@ -99,6 +243,19 @@ private:
   /// The thread that accepts connections on the listening socket.
   pthread_t _listen_thread;
 
+  /// The I/O threads, and the index of the one to hand the next accepted
+  /// connection to.
+  int _num_io_threads;
+  std::vector<IOThread*> _io_threads;
+  size_t _next_io_thread;
+
+  /// The worker threads, and the queue of requests waiting for them.
+  int _num_worker_threads;
+  std::vector<pthread_t> _worker_threads;
+  std::deque<Request> _request_queue;
+  pthread_mutex_t _request_queue_lock;
+  pthread_cond_t _request_queue_cond;
+
   /// The class used to access the local cluster of memcached instances.
   MemcachedBackend* _backend;
 };
@@ -0,0 +1,122 @@
+/**
+ * @file rate_limiter.hpp - Token bucket rate limiter
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef RATE_LIMITER_HPP__
+#define RATE_LIMITER_HPP__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+// Limits the rate at which some resource (such as bytes or operations) is
+// used, using a token bucket. The bucket holds up to one second's worth of
+// tokens, so short bursts are allowed but the long-term rate is capped.
+//
+// Unlike throttling the whole process, this only slows down the threads that
+// use the limiter.
+class RateLimiter
+{
+public:
+  // @param rate - The number of tokens added to the bucket per second. Zero
+  //               means there is no limit.
+  RateLimiter(uint64_t rate);
+  ~RateLimiter();
+
+  // Use some tokens, first blocking the calling thread for as long as it takes
+  // for the bucket to hold them. This is safe to call from multiple threads.
+  // Tokens are handed out in the order they are asked for.
+  void consume(uint64_t tokens);
+
+  // Change the rate of the limiter.
+  void set_rate(uint64_t rate);
+  uint64_t rate();
+
+private:
+  void refill();
+
+  pthread_mutex_t _lock;
+  uint64_t _rate;
+
+  // The number of tokens in the bucket. This goes negative when tokens have
+  // been promised to threads that are still waiting for them.
+  double _tokens;
+  struct timespec _last_refill;
+};
+
+// Adjusts the rate of a RateLimiter to hold the 99th percentile latency of
+// some operation at a target, using additive increase / multiplicative
+// decrease.
+//
+// The latencies are collected over periods of a second. At the end of each
+// period, if the 99th percentile latency was over the target the rate is
+// halved, and otherwise it is increased by a twentieth of the maximum rate.
+// The rate is kept between a hundredth of the maximum rate and the maximum.
+class LatencyController
+{
+public:
+  // @param limiter           - The limiter to control. The caller retains
+  //                            ownership.
+  // @param max_rate          - The highest rate the limiter may be set to.
+  // @param target_latency_us - The target 99th percentile latency. Zero means
+  //                            the rate is not adjusted.
+  LatencyController(RateLimiter* limiter,
+                    uint64_t max_rate,
+                    uint64_t target_latency_us);
+  ~LatencyController();
+
+  // Record the latency of an operation.
+  //
+  // @returns - Whether the rate of the limiter has been changed.
+  bool record_latency(uint64_t latency_us);
+
+  // The current rate of the limiter as a percentage of the maximum rate.
+  uint32_t level();
+
+private:
+  static const uint64_t PERIOD_US = 1000000;
+
+  pthread_mutex_t _lock;
+  RateLimiter* _limiter;
+  uint64_t _max_rate;
+  uint64_t _min_rate;
+  uint64_t _target_latency_us;
+  uint64_t _rate;
+  std::vector<uint64_t> _latencies;
+  struct timespec _period_start;
+};
+
+#endif
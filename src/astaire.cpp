@@ -38,12 +38,32 @@
 #include "astaire.hpp"
 #include "astaire_pd_definitions.hpp"
 #include <algorithm>
+#include <bitset>
 #include <set>
+#include <poll.h>
 
 const std::string ASTAIRE_KEY_PREFIX = "astaire\\\\";
 const std::string ASTAIRE_TAG_KEY = ASTAIRE_KEY_PREFIX + "tag";
 const std::string ASTAIRE_TAG_VALUE = "{}";
 
+// Checkpoint records mark the vbuckets that have been completely resynced, so
+// that an interrupted resync can carry on where it left off. They live under
+// the Astaire key prefix, so are never streamed between nodes.
+const std::string ASTAIRE_CHECKPOINT_KEY_PREFIX = ASTAIRE_KEY_PREFIX + "resynced\\\\";
+
+// The number of vbuckets in the cluster.
+const int NUM_VBUCKETS = 128;
+
+// How often the monitor thread tries to reconnect to the local memcached after
+// losing its connection, and how often it checks whether it should exit.
+const int MONITOR_RECONNECT_INTERVAL_MS = 50;
+const int MONITOR_POLL_INTERVAL_MS = 100;
+
+// The most mutations to inject into the local memcached in one batch, and the
+// total size of the mutations in a batch beyond which no more are added.
+const size_t MAX_INJECT_BATCH = 256;
+const size_t MAX_INJECT_BATCH_BYTES = 1024 * 1024;
+
 // Utility function to search a vector.
 template<class T>
 inline bool is_in_vector(const std::vector<T>& vec, const T& item)
@@ -60,8 +80,15 @@ Astaire::Astaire(MemcachedStoreView* view,
                  Alarm* alarm,
                  AstaireGlobalStatistics* global_stats,
                  AstairePerConnectionStatistics* per_conn_stats,
-                 std::string self) :
+                 std::string self,
+                 int tap_fanout,
+                 uint64_t tap_bandwidth_limit,
+                 uint64_t inject_rate_limit,
+                 uint64_t inject_latency_target_us,
+                 std::string local_socket) :
   _terminated(false),
+  _monitor_terminated(false),
+  _local_restart_generation(0),
   _view_updated(false),
   _view(view),
   _view_cfg(view_cfg),
@@ -69,9 +96,19 @@ Astaire::Astaire(MemcachedStoreView* view,
   _alarm(alarm),
   _global_stats(global_stats),
   _per_conn_stats(per_conn_stats),
-  _self(self)
+  _self(self),
+  _local_address(local_socket.empty() ? self : local_socket),
+  _local_conn(new Memcached::ClientConnection(_local_address)),
+  _local_conn_generation(0),
+  _tap_fanout(std::max(tap_fanout, 1)),
+  _tap_limiter(new RateLimiter(tap_bandwidth_limit)),
+  _inject_limiter(new RateLimiter(inject_rate_limit)),
+  _inject_controller(new LatencyController(_inject_limiter,
+                                           inject_rate_limit,
+                                           inject_latency_target_us))
 {
   pthread_mutex_init(&_lock, NULL);
+  pthread_mutex_init(&_local_conn_lock, NULL);
   pthread_condattr_t cond_attr;
   pthread_condattr_init(&cond_attr);
   pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
@@ -81,6 +118,9 @@ Astaire::Astaire(MemcachedStoreView* view,
   // Start the controller thread.
   pthread_create(&_control_thread_hdl, NULL, control_thread_fn, this);
 
+  // Start the thread that watches for the local memcached restarting.
+  pthread_create(&_monitor_thread_hdl, NULL, monitor_thread_fn, this);
+
   // Start the updater to handle SIGHUPs
   _sighup_updater = new Updater<void, Astaire>(this,
                                                std::mem_fun(&Astaire::reload_config));
@@ -99,6 +139,10 @@ Astaire::~Astaire()
   delete _sighup_updater; _sighup_updater = NULL;
   delete _sigusr1_updater; _sigusr1_updater = NULL;
 
+  // Stop the monitor thread.
+  _monitor_terminated.store(true);
+  pthread_join(_monitor_thread_hdl, NULL);
+
   // Signal the controller thread to terminate.
   pthread_mutex_lock(&_lock);
   _terminated = true;
@@ -108,7 +152,13 @@ Astaire::~Astaire()
   // Now wait for the controller to exit.
   pthread_join(_control_thread_hdl, NULL);
 
+  delete _tap_limiter; _tap_limiter = NULL;
+  delete _local_conn; _local_conn = NULL;
+  delete _inject_controller; _inject_controller = NULL;
+  delete _inject_limiter; _inject_limiter = NULL;
+
   pthread_cond_destroy(&_cv);
+  pthread_mutex_destroy(&_local_conn_lock);
   pthread_mutex_destroy(&_lock);
 }
 
@@ -151,11 +201,22 @@ void Astaire::control_thread()
 {
   pthread_mutex_lock(&_lock);
 
+  uint64_t last_restart_generation = _local_restart_generation.load();
+
   while (!_terminated)
   {
     bool resync = false;
     bool full_resync = false;
 
+    // Note the restart generation before polling the local memcached, so
+    // that a restart at any point after the poll stops the resync.
+    uint64_t restart_generation = _local_restart_generation.load();
+    if (restart_generation != last_restart_generation)
+    {
+      TRC_DEBUG("Local memcached may have restarted - check whether it is up-to-date");
+      last_restart_generation = restart_generation;
+    }
+
     if (_view_updated)
     {
       TRC_DEBUG("View has been updated - resync required");
@@ -171,8 +232,10 @@ void Astaire::control_thread()
       full_resync = true;
 
       // Mark the local memcached as out-of-date. This means if we crash during
-      // the resync we will restart it when we come back.
+      // the resync we will restart it when we come back. Any checkpoints from
+      // an earlier resync are discarded so that every vbucket is streamed.
       untag_local_memcached();
+      clear_checkpoints();
     }
 
     PollResult res = poll_local_memcached();
@@ -185,13 +248,28 @@ void Astaire::control_thread()
 
     if (resync)
     {
-      do_resync(full_resync);
+      do_resync(full_resync, restart_generation);
 
       // Tag the local memcached to mark it as up-to-date, even if the resync
       // failed. The most likely cause for a failure is that all the replicas for
       // some vbuckets are down which means the bucket's data has been lost and
       // there is no point in trying to resync it again.
-      tag_local_memcached();
+      //
+      // The checkpoints are cleared first, so that they can't cause a later
+      // resync to skip vbuckets.
+      //
+      // If the local memcached restarted during the resync it has lost the
+      // data we've just injected, so must not be tagged. The next poll will
+      // find it's out-of-date and start a full resync.
+      if (_local_restart_generation.load() != restart_generation)
+      {
+        TRC_INFO("Local memcached restarted during resync - not tagging it");
+      }
+      else
+      {
+        clear_checkpoints();
+        tag_local_memcached();
+      }
     }
     else
     {
@@ -210,6 +288,64 @@ void Astaire::control_thread()
   pthread_mutex_unlock(&_lock);
 }
 
+// Method executed by the monitor thread.
+//
+// This holds an idle connection open to the local memcached. Memcached never
+// sends anything on an idle connection, so if the socket becomes readable the
+// connection has been closed, which almost always means memcached has
+// restarted. Once the monitor has reconnected, it kicks the control thread to
+// check whether the local memcached is still up-to-date. This means a restart
+// is noticed as soon as memcached is back, rather than at the next periodic
+// poll.
+void Astaire::monitor_thread()
+{
+  Memcached::ClientConnection conn(_local_address);
+  bool lost_connection = false;
+
+  while (!_monitor_terminated.load())
+  {
+    if (!conn.connected())
+    {
+      if (conn.connect() != 0)
+      {
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = MONITOR_RECONNECT_INTERVAL_MS * 1000 * 1000;
+        nanosleep(&ts, NULL);
+        continue;
+      }
+
+      if (lost_connection)
+      {
+        TRC_INFO("Reconnected to local memcached");
+        lost_connection = false;
+
+        // The restart was flagged when the connection was lost. Just wake
+        // the control thread so it checks the local memcached straight away.
+        pthread_mutex_lock(&_lock);
+        pthread_cond_signal(&_cv);
+        pthread_mutex_unlock(&_lock);
+      }
+    }
+
+    struct pollfd pfd;
+    pfd.fd = conn.sock();
+    pfd.events = POLLIN | POLLRDHUP;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, MONITOR_POLL_INTERVAL_MS) > 0)
+    {
+      TRC_INFO("Lost connection to local memcached - it may have restarted");
+      conn.disconnect();
+      lost_connection = true;
+
+      // Stop any resync that's in progress as soon as possible, as whatever
+      // it injects will have to be injected again.
+      _local_restart_generation.fetch_add(1);
+    }
+  }
+}
+
 /*****************************************************************************/
 /* Static functions                                                          */
 /*****************************************************************************/
@@ -221,7 +357,14 @@ void* Astaire::control_thread_fn(void* data)
   return NULL;
 }
 
-// This thread simply performs the TAP specified in the passed object and
+// Function for the monitor thread.
+void* Astaire::monitor_thread_fn(void* data)
+{
+  ((Astaire*)data)->monitor_thread();
+  return NULL;
+}
+
+// This function simply performs the TAP specified in the passed object and
 // updates the success flag appropriately.
 void* Astaire::tap_buckets_thread(void *data)
 {
@@ -262,177 +405,141 @@ void* Astaire::tap_buckets_thread(void *data)
   Memcached::TapConnectReq tap(tap_data->buckets);
   tap_conn.send(tap);
 
+  // The vbuckets we're streaming. Most of the mutations on the TAP are for
+  // other vbuckets, so this needs to be quick to check.
+  std::bitset<NUM_VBUCKETS> buckets;
+  for (std::vector<uint16_t>::const_iterator it = tap_data->buckets.begin();
+       it != tap_data->buckets.end();
+       ++it)
+  {
+    buckets.set(*it);
+  }
+
+  std::vector<PendingMutation> batch;
+  batch.reserve(MAX_INJECT_BATCH);
+  std::set<std::string> batch_keys;
+  size_t batch_bytes = 0;
+
   bool finished = false;
   do
   {
-    Memcached::BaseMessage* msg;
-    Memcached::Status status = tap_conn.recv(&msg);
-    if (status == Memcached::Status::ERROR)
-    {
-      tap_data->success = false;
-      finished = true;
-      break;
-    }
-    else if (status == Memcached::Status::DISCONNECTED)
+    // Wait for the next message, then pick up any others that have already
+    // been received so that they can be injected as a single batch.
+    //
+    // Look at each message in place. Most of the messages are mutations that
+    // we're going to discard, so it's not worth parsing them fully until we
+    // know we need to.
+    Memcached::MsgView msg;
+    Memcached::Status status = tap_conn.recv(msg);
+    size_t recv_bytes = 0;
+    uint32_t discarded_bytes = 0;
+
+    while ((status == Memcached::Status::OK) && (!msg.empty()))
     {
-      finished = true;
-      break;
-    }
+      recv_bytes += msg.length();
 
-    if (msg->is_response())
-    {
-      Memcached::BaseRsp* rsp = (Memcached::BaseRsp*)msg;
-      if (rsp->op_code() == (uint8_t)Memcached::OpCode::TAP_CONNECT)
+      if (!msg.is_request())
       {
-        // TAP_CONNECT should not be replied to, if it has, it is to
-        // say that the message was not understood.
-        TRC_ERROR("Cannot tap %s as the TAP protocol was not supported",
-                  tap_data->tap_server.c_str());
-        tap_data->success = false;
-        finished = true;
+        if (msg.op_code() == (uint8_t)Memcached::OpCode::TAP_CONNECT)
+        {
+          // TAP_CONNECT should not be replied to, if it has, it is to
+          // say that the message was not understood.
+          TRC_ERROR("Cannot tap %s as the TAP protocol was not supported",
+                    tap_data->tap_server.c_str());
+          tap_data->success = false;
+          finished = true;
+          break;
+        }
       }
-    }
-    else
-    {
-      Memcached::BaseReq* req = (Memcached::BaseReq*)msg;
-
-      if (req->op_code() == (uint8_t)Memcached::OpCode::TAP_MUTATE)
+      else if (msg.op_code() == (uint8_t)Memcached::OpCode::TAP_MUTATE)
       {
-        Memcached::TapMutateReq* mutate = (Memcached::TapMutateReq*)req;
-
-        // Ths can be removed once memcached returns vbuckets on
-        // TAP_MUTATE requests
-        uint16_t vbucket = vbucket_for_key(mutate->key());
-        TRC_DEBUG("Received TAP_MUTATE for key %s from bucket %d",
-                  mutate->key().c_str(),
+        // Use the vbucket from the header if memcached has filled it in.
+        // Otherwise we have to work it out from the key.
+        uint16_t vbucket = msg.vbucket_or_status();
+        if ((vbucket == 0) || (vbucket >= NUM_VBUCKETS))
+        {
+          vbucket = vbucket_for_key(msg.key(), msg.key_length());
+        }
+        TRC_DEBUG("Received TAP_MUTATE for key %.*s from bucket %d",
+                  (int)msg.key_length(),
+                  msg.key(),
                   vbucket);
 
-        std::vector<uint16_t>::iterator iter =
-          std::find(tap_data->buckets.begin(),
-                    tap_data->buckets.end(),
-                    vbucket);
-        if (iter == tap_data->buckets.end())
+        if (!buckets[vbucket])
         {
           TRC_DEBUG("Disarding TAP_MUTATE for incorrect vBucket");
+          discarded_bytes += msg.length();
         }
-        else if (mutate->key().find(ASTAIRE_KEY_PREFIX) == 0)
+        else if ((msg.key_length() >= ASTAIRE_KEY_PREFIX.length()) &&
+                 (ASTAIRE_KEY_PREFIX.compare(0,
+                                             std::string::npos,
+                                             msg.key(),
+                                             ASTAIRE_KEY_PREFIX.length()) == 0))
         {
           TRC_DEBUG("Disarding TAP_MUTATE for Astaire tag record");
+          discarded_bytes += msg.length();
         }
         else
         {
-          TRC_DEBUG("GETing record from local memcached");
-          Memcached::GetReq get(mutate->key(), 0);
-          local_conn.send(get);
+          std::string key(msg.key(), msg.key_length());
 
-          Memcached::BaseMessage* base_msg;
-          Memcached::Status status = local_conn.recv(&base_msg);
-          if (status != Memcached::Status::OK)
+          if (batch_keys.find(key) != batch_keys.end())
           {
-            TRC_ERROR("Lost connection with local memcached instance");
-            tap_data->success = false;
-            continue;
-          }
-
-          // Check this is a Get response and cast it if so.
-          if ((!base_msg->is_response()) ||
-              (base_msg->op_code() != (uint8_t)Memcached::OpCode::GET))
-          {
-            TRC_ERROR("Received unexpected message from local memcached instance (%x)", base_msg->op_code());
-            tap_data->success = false;
-            delete base_msg; base_msg = NULL;
-            continue;
-          }
-          Memcached::GetRsp* get_rsp = (Memcached::GetRsp*)base_msg;
-          base_msg = NULL;
-
-          // Examine Get response to determine whether to Add or Replace the key.
-          bool do_add = false;
-          bool do_replace = false;
-          uint64_t cas = 0;
-          if (get_rsp->result_code() == (uint8_t)Memcached::ResultCode::NO_ERROR)
-          {
-            // The flags field encodes a timestamp.  Calculate the difference.
-            // If the timestamp in the Get response is earlier than that in the
-            // Mutate, replace the value stored in the local memcached.
-            if (((int32_t)get_rsp->flags()) - ((int32_t)mutate->flags()) < 0)
+            // We already have a mutation for this key. Inject the batch now
+            // so that this mutation is compared against the earlier one.
+            if (!inject_mutations(local_conn, batch, tap_data))
             {
-              do_replace = true;
-              cas = get_rsp->cas();
-            }
-          }
-          else if (get_rsp->result_code() == (uint8_t)Memcached::ResultCode::KEY_NOT_FOUND)
-          {
-            do_add = true;
-          }
-          else
-          {
-            TRC_STATUS("Received unexpected Get response result code %x", get_rsp->result_code());
-            tap_data->success = false;
-            delete get_rsp; get_rsp = NULL;
-            continue;
-          }
-          delete get_rsp; get_rsp = NULL;
-
-          // Now actually do the Add or Replace (if required).
-          if (do_add)
-          {
-            Memcached::AddReq add(mutate->key(),
-                                  vbucket,
-                                  mutate->value(),
-                                  mutate->flags(),
-                                  mutate->expiry());
-            local_conn.send(add);
-
-            Memcached::BaseMessage* add_rsp;
-            Memcached::Status status = local_conn.recv(&add_rsp);
-            if (status != Memcached::Status::OK)
-            {
-              TRC_ERROR("Lost connection with local memcached instance");
-              tap_data->success = false;
-              continue;
-            }
-            delete add_rsp;
-          }
-          else if (do_replace)
-          {
-            Memcached::ReplaceReq replace(mutate->key(),
-                                          vbucket,
-                                          mutate->value(),
-                                          cas,
-                                          mutate->flags(),
-                                          mutate->expiry());
-            local_conn.send(replace);
-
-            Memcached::BaseMessage* replace_rsp;
-            Memcached::Status status = local_conn.recv(&replace_rsp);
-            if (status != Memcached::Status::OK)
-            {
-              TRC_ERROR("Lost connection with local memcached instance");
               tap_data->success = false;
-              continue;
+              finished = true;
+              break;
             }
-            delete replace_rsp;
+            batch_keys.clear();
+            batch_bytes = 0;
           }
 
-          // Update global and local stats
-          tap_data->global_stats->increment_resynced_keys_count(1);
-          uint32_t bytes = mutate->to_wire().size();
-          tap_data->global_stats->increment_resynced_bytes_count(bytes);
-          tap_data->global_stats->increment_bandwidth(bytes);
-
-          tap_data->conn_stats->lock();
-          AstairePerConnectionStatistics::BucketRecord* bucket_stats =
-            tap_data->conn_stats->get_bucket_stats(vbucket);
-          bucket_stats->increment_resynced_keys_count(1);
-          bucket_stats->increment_resynced_bytes_count(bytes);
-          bucket_stats->increment_bandwidth(bytes);
-          tap_data->conn_stats->unlock();
+          batch.push_back(PendingMutation(vbucket, msg));
+          batch_keys.insert(key);
+          batch_bytes += msg.length();
         }
       }
+
+      if ((batch.size() >= MAX_INJECT_BATCH) ||
+          (batch_bytes >= MAX_INJECT_BATCH_BYTES))
+      {
+        break;
+      }
+
+      status = tap_conn.recv_buffered(msg);
     }
 
-    delete msg; msg = NULL;
+    // Wait until we're allowed to have received these bytes. While we wait,
+    // the TCP window fills up and the remote server stops sending.
+    tap_data->tap_limiter->consume(recv_bytes);
+
+    if (discarded_bytes > 0)
+    {
+      tap_data->global_stats->increment_discarded_bytes_count(discarded_bytes);
+    }
+
+    if (status == Memcached::Status::ERROR)
+    {
+      tap_data->success = false;
+      finished = true;
+    }
+    else if (status == Memcached::Status::DISCONNECTED)
+    {
+      finished = true;
+    }
+
+    // Inject whatever we've collected, even if the TAP has finished.
+    if ((!batch.empty()) &&
+        (!inject_mutations(local_conn, batch, tap_data)))
+    {
+      tap_data->success = false;
+      finished = true;
+    }
+    batch_keys.clear();
+    batch_bytes = 0;
   }
   while (!finished);
 
@@ -451,6 +558,235 @@ void* Astaire::tap_buckets_thread(void *data)
   return (void*)tap_data;
 }
 
+// Record the round trip time of a batch of requests to the local memcached
+// that was sent at the specified time, adjusting the injection rate (and the
+// reported throttle level) if necessary.
+//
+// The controller is given the time per request, rather than the time for the
+// whole batch, so that its target doesn't depend on how big the batches are.
+void Astaire::record_local_rtt(const struct timespec& start,
+                               uint32_t num_requests,
+                               TapBucketsThreadData* tap_data)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t rtt_us = (now.tv_sec - start.tv_sec) * 1000000 +
+                    (now.tv_nsec - start.tv_nsec) / 1000;
+
+  uint64_t latency_us = rtt_us / std::max(num_requests, 1u);
+
+  if (tap_data->inject_controller->record_latency(latency_us))
+  {
+    tap_data->global_stats->set_throttle_level(tap_data->inject_controller->level());
+  }
+}
+
+// Inject a batch of mutations received over TAP into the local memcached,
+// replacing the local copy of each record only if it is older than the one
+// received. The batch is emptied.
+//
+// Rather than doing a round trip per key, this sends a GETKQ for every key
+// followed by a NOOP, and then a quiet ADD or REPLACE for every key that
+// needs one, again followed by a NOOP. The opaque of each request is the
+// index of its mutation in the batch, so that responses can be matched up.
+//
+// Returns false if the connection to the local memcached has failed.
+bool Astaire::inject_mutations(Memcached::ClientConnection& local_conn,
+                               std::vector<PendingMutation>& batch,
+                               TapBucketsThreadData* tap_data)
+{
+  enum Action { ADD, REPLACE, SKIP };
+
+  uint32_t batch_size = batch.size();
+  std::vector<Action> actions(batch_size, ADD);
+  std::vector<uint64_t> cas(batch_size, 0);
+
+  // Wait until we're allowed to inject this many records.
+  tap_data->inject_limiter->consume(batch_size);
+
+  TRC_DEBUG("GETing %d records from local memcached", batch_size);
+
+  std::vector<Memcached::GetReq> gets;
+  std::vector<const Memcached::BaseMessage*> reqs;
+  gets.reserve(batch_size);
+  reqs.reserve(batch_size + 1);
+
+  for (uint32_t ii = 0; ii < batch_size; ++ii)
+  {
+    gets.push_back(Memcached::GetReq(batch[ii].mutate.key(),
+                                     ii,
+                                     (uint8_t)Memcached::OpCode::GETKQ));
+    reqs.push_back(&gets.back());
+  }
+
+  Memcached::NoopReq get_noop(batch_size);
+  reqs.push_back(&get_noop);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!local_conn.send(reqs))
+  {
+    TRC_ERROR("Lost connection with local memcached instance");
+    batch.clear();
+    return false;
+  }
+
+  // Misses aren't reported, so we get a response for each key that's already
+  // present (or that hit an error), and then the NOOP response.
+  while (true)
+  {
+    Memcached::MsgView rsp;
+    Memcached::Status status = local_conn.recv(rsp);
+    if (status != Memcached::Status::OK)
+    {
+      TRC_ERROR("Lost connection with local memcached instance");
+      batch.clear();
+      return false;
+    }
+
+    if ((!rsp.is_request()) &&
+        (rsp.op_code() == (uint8_t)Memcached::OpCode::NOOP))
+    {
+      record_local_rtt(start, reqs.size(), tap_data);
+      break;
+    }
+
+    // Check this is a response to one of our GETs.
+    uint32_t idx = rsp.opaque();
+    if ((rsp.is_request()) ||
+        (rsp.op_code() != (uint8_t)Memcached::OpCode::GETKQ) ||
+        (idx >= batch_size))
+    {
+      TRC_ERROR("Received unexpected message from local memcached instance (%x)", rsp.op_code());
+      batch.clear();
+      return false;
+    }
+
+    // Examine Get response to determine whether to Replace the key.
+    if (rsp.vbucket_or_status() == (uint16_t)Memcached::ResultCode::NO_ERROR)
+    {
+      uint32_t flags = (rsp.extra_length() >= sizeof(uint32_t)) ?
+                         Memcached::Utils::read<uint32_t>(rsp.extra()) : 0;
+
+      // The flags field encodes a timestamp.  Calculate the difference.
+      // If the timestamp in the Get response is earlier than that in the
+      // Mutate, replace the value stored in the local memcached.
+      if (((int32_t)flags) - ((int32_t)batch[idx].mutate.flags()) < 0)
+      {
+        actions[idx] = REPLACE;
+        cas[idx] = rsp.cas();
+      }
+      else
+      {
+        actions[idx] = SKIP;
+      }
+    }
+    else
+    {
+      TRC_STATUS("Received unexpected Get response result code %x", rsp.vbucket_or_status());
+      tap_data->success = false;
+      actions[idx] = SKIP;
+    }
+  }
+
+  // Now actually do the Adds and Replaces.
+  std::vector<Memcached::SetAddReplaceReq> writes;
+  reqs.clear();
+  writes.reserve(batch_size);
+
+  for (uint32_t ii = 0; ii < batch_size; ++ii)
+  {
+    const Memcached::TapMutateReq& mutate = batch[ii].mutate;
+
+    if (actions[ii] != SKIP)
+    {
+      writes.push_back(Memcached::SetAddReplaceReq(
+                         (actions[ii] == ADD) ? (uint8_t)Memcached::OpCode::ADDQ :
+                                                (uint8_t)Memcached::OpCode::REPLACEQ,
+                         mutate.key(),
+                         batch[ii].vbucket,
+                         mutate.value(),
+                         cas[ii],
+                         mutate.flags(),
+                         mutate.expiry(),
+                         ii));
+      reqs.push_back(&writes.back());
+    }
+  }
+
+  if (!writes.empty())
+  {
+    Memcached::NoopReq write_noop(batch_size);
+    reqs.push_back(&write_noop);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!local_conn.send(reqs))
+    {
+      TRC_ERROR("Lost connection with local memcached instance");
+      batch.clear();
+      return false;
+    }
+
+    // Only failures are reported. These are expected if the record has been
+    // written by a client in the meantime, in which case the client's write
+    // wins.
+    while (true)
+    {
+      Memcached::MsgView rsp;
+      Memcached::Status status = local_conn.recv(rsp);
+      if (status != Memcached::Status::OK)
+      {
+        TRC_ERROR("Lost connection with local memcached instance");
+        batch.clear();
+        return false;
+      }
+
+      if ((!rsp.is_request()) &&
+          (rsp.op_code() == (uint8_t)Memcached::OpCode::NOOP))
+      {
+        record_local_rtt(start, reqs.size(), tap_data);
+        break;
+      }
+
+      TRC_DEBUG("Write of record %d returned result code %x",
+                rsp.opaque(),
+                rsp.vbucket_or_status());
+    }
+  }
+
+  // Update global and local stats. The per-bucket stats are only touched by
+  // this thread, so this doesn't need to take any locks.
+  uint32_t batch_bytes = 0;
+  uint32_t skipped_bytes = 0;
+
+  for (uint32_t ii = 0; ii < batch_size; ++ii)
+  {
+    uint32_t bytes = batch[ii].length;
+    batch_bytes += bytes;
+
+    if (actions[ii] == SKIP)
+    {
+      skipped_bytes += bytes;
+    }
+
+    tap_data->conn_stats->record_resynced_key(batch[ii].vbucket, bytes);
+  }
+
+  tap_data->global_stats->increment_resynced_keys_count(batch_size);
+  tap_data->global_stats->increment_resynced_bytes_count(batch_bytes);
+  tap_data->global_stats->increment_bandwidth(batch_bytes);
+
+  if (skipped_bytes > 0)
+  {
+    tap_data->global_stats->increment_skipped_bytes_count(skipped_bytes);
+  }
+
+  batch.clear();
+  return true;
+}
+
 /*****************************************************************************/
 /* Private functions                                                         */
 /*****************************************************************************/
@@ -459,12 +795,18 @@ void* Astaire::tap_buckets_thread(void *data)
 // will automatically calculate the TAPs required and process them to completion
 // or failure.
 //
-// @param full_resync - Whether to do a full-resync or a minimal-resync.
-void Astaire::do_resync(bool full_resync)
+// @param full_resync        - Whether to do a full-resync or a
+//                             minimal-resync.
+// @param restart_generation - The local memcached's restart generation when
+//                             it was last polled. The resync stops if this
+//                             changes.
+void Astaire::do_resync(bool full_resync, uint64_t restart_generation)
 {
   TRC_DEBUG("Start resync operation");
 
   OutstandingWorkList owl = calculate_worklist(full_resync);
+  skip_checkpointed_buckets(owl);
+
   if (owl.empty())
   {
     TRC_INFO("No resyncing required");
@@ -479,7 +821,7 @@ void Astaire::do_resync(bool full_resync)
     _alarm->set();
   }
 
-  process_worklist(owl);
+  process_worklist(owl, restart_generation);
 
   if (_alarm)
   {
@@ -488,7 +830,9 @@ void Astaire::do_resync(bool full_resync)
   CL_ASTAIRE_COMPLETE_RESYNC.log();
 
   _global_stats->reset();
+  _per_conn_stats->lock();
   _per_conn_stats->reset();
+  _per_conn_stats->unlock();
 }
 
 // Calculate the OWL for a resync operation.
@@ -553,75 +897,68 @@ Astaire::OutstandingWorkList Astaire::calculate_worklist(bool full_resync)
   return owl;
 }
 
-// The core of Astaire's work.  This function iterates around the OWL,
-// attempting to fetch vbuckets from each replica that owns the vbucket.
+// The core of Astaire's work.  This function works through the OWL,
+// fetching each vbucket from each replica that owns the vbucket.
 //
-// For a given vbucket this function first fetches it from the primary replica,
-// then each backup replica in turn. Fetching from all replicas avoids data
-// loss if one of the replicas has recently restarted (and is missing some
-// records), and processing each replica in turn avoids race conditions that
-// could cause the local node to end up with old data.
-void Astaire::process_worklist(OutstandingWorkList& owl)
+// Each vbucket is fetched from every replica that owns it. Fetching from all
+// replicas avoids data loss if one of the replicas has recently restarted (and
+// is missing some records), and only ever streaming a vbucket from one replica
+// at a time avoids race conditions that could cause the local node to end up
+// with old data. The replicas don't need to be streamed from in any particular
+// order, as records are only injected if they are newer than the local copy.
+//
+// The work is done by a pool of worker threads, each of which repeatedly
+// picks a set of vbuckets that are ready to be streamed from the same server
+// and TAPs them. A vbucket is ready when it is not already being streamed and
+// still has replicas left to stream from. The vbuckets are spread across all
+// the replicas they could be streamed from, rather than always starting with
+// the primary, so that every server is kept busy. Workers never wait for each
+// other except when there is nothing ready, so a slow server only holds up
+// the vbuckets that are being streamed from it. If a TAP fails, the server is
+// removed from the OWL and its vbuckets are immediately ready to be streamed
+// from their other replicas.
+void Astaire::process_worklist(OutstandingWorkList& owl,
+                               uint64_t restart_generation)
 {
-  // Create a set of vbuckets that have not be successfully streamed yet. If
-  // this set is not empty at the end of the method, then something has gone
-  // wrong.
-  std::set<int> unstreamed_buckets;
+  ResyncWork work(this, owl, restart_generation);
+
+  // Have enough workers to run the configured number of TAPs to every server.
+  std::set<std::string> servers;
   for (OutstandingWorkList::const_iterator it = owl.begin();
        it != owl.end();
        ++it)
   {
-    unstreamed_buckets.insert(it->first);
+    servers.insert(it->second.begin(), it->second.end());
   }
+  size_t num_workers = servers.size() * _tap_fanout;
 
-  while (!owl_empty(owl))
+  std::vector<pthread_t> workers;
+  workers.reserve(num_workers);
+  for (size_t ii = 0; ii < num_workers; ++ii)
   {
-    // Calculate the taps to establish. This modifies the OWL in place.
-    TapList taps = calculate_taps(owl);
-
-    std::vector<pthread_t> tap_handles;
-    tap_handles.reserve(taps.size());
-    for (TapList::iterator taps_it = taps.begin();
-         taps_it != taps.end();
-         ++taps_it)
+    pthread_t handle;
+    int rc = pthread_create(&handle, NULL, resync_worker_thread_fn, (void*)&work);
+    if (rc != 0)
     {
-      // Kick off a TAP on this server.
-      pthread_t handle;
-      bool rc = perform_single_tap(taps_it->first, taps_it->second, &handle);
-      if (rc)
-      {
-        tap_handles.push_back(handle);
-      }
+      TRC_ERROR("Failed to create resync worker thread (%d)", rc);
+      continue;
     }
+    workers.push_back(handle);
+  }
 
-    for (std::vector<pthread_t>::iterator handle_it = tap_handles.begin();
-         handle_it != tap_handles.end();
-         ++handle_it)
-    {
-      std::string server;
-      bool success = complete_single_tap(*handle_it, server);
-
-      if (success)
-      {
-        TRC_VERBOSE("Tap of %s completed successfully", server.c_str());
+  for (std::vector<pthread_t>::iterator it = workers.begin();
+       it != workers.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
 
-        // Tap successful. Its buckets have now been successfully streamed.
-        for (std::vector<uint16_t>::const_iterator bucket_it = taps[server].begin();
-             bucket_it != taps[server].end();
-             ++bucket_it)
-        {
-          unstreamed_buckets.erase(*bucket_it);
-        }
-      }
-      else
-      {
-        TRC_VERBOSE("Tap of %s failed", server.c_str());
-        blacklist_server(owl, server);
-      }
-    }
+  if (workers.empty())
+  {
+    TRC_ERROR("No resync worker threads could be created");
   }
 
-  if (unstreamed_buckets.empty())
+  if (work.unstreamed_buckets.empty())
   {
     TRC_VERBOSE("Resync suceeded");
   }
@@ -632,89 +969,266 @@ void Astaire::process_worklist(OutstandingWorkList& owl)
   }
 }
 
-// Convert an OWL into a list of TAPs to perform.  This algorithm choses the
-// first available server for each bucket and removes this server from the OWL.
-Astaire::TapList Astaire::calculate_taps(OutstandingWorkList& owl)
+Astaire::ResyncWork::ResyncWork(Astaire* astaire,
+                                const OutstandingWorkList& owl,
+                                uint64_t restart_generation) :
+  astaire(astaire),
+  restart_generation(restart_generation),
+  sources(owl),
+  owl(owl),
+  in_flight(),
+  active_taps(),
+  unstreamed_buckets()
 {
-  TapList tl;
-
-  for (OutstandingWorkList::iterator owl_it = owl.begin();
-       owl_it != owl.end();
-       ++owl_it)
+  // Create a set of vbuckets that have not be successfully streamed yet. If
+  // this set is not empty at the end of the resync, then something has gone
+  // wrong.
+  for (OutstandingWorkList::const_iterator it = owl.begin();
+       it != owl.end();
+       ++it)
   {
-    int vbucket = owl_it->first;
-    std::vector<std::string>& replica_list = owl_it->second;
+    unstreamed_buckets.insert(it->first);
+  }
 
-    if (!replica_list.empty())
-    {
-      std::string replica = replica_list[0];
-      tl[replica].push_back(vbucket);
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+}
 
-      // Erase the replica from the OWL. This is safe do do while iterating
-      // since we are not adding a new key to the OWL map (guaranteed safe by
-      // C++).
-      replica_list.erase(replica_list.begin());
-    }
-  }
+Astaire::ResyncWork::~ResyncWork()
+{
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
 
-  return tl;
+// Entry point for the resync worker threads.
+void* Astaire::resync_worker_thread_fn(void* data)
+{
+  ResyncWork* work = (ResyncWork*)data;
+  work->astaire->resync_worker(*work);
+  return NULL;
 }
 
-// Kick off a tap of a single server for the given vBuckets.
+// Method executed by each resync worker thread. This TAPs sets of vbuckets
+// until there are none left.
 //
-// On success, returns the handle of the thread being used to process the
-// tap.  Calling code can wait for this thread to complete by calling
-// `complete_single_tap`.
-bool Astaire::perform_single_tap(const std::string& server,
-                                 const std::vector<uint16_t>& buckets,
-                                 pthread_t* handle)
+// This runs without the Astaire lock (which the control thread holds for the
+// duration of the resync), so only uses state that doesn't change while a
+// resync is in progress.
+void Astaire::resync_worker(ResyncWork& work)
 {
-  _per_conn_stats->lock();
-  AstairePerConnectionStatistics::ConnectionRecord* conn_stat =
-    _per_conn_stats->add_connection(server, buckets);
-  _per_conn_stats->unlock();
+  std::string server;
+  std::vector<uint16_t> buckets;
 
-  TapBucketsThreadData* thread_data = new TapBucketsThreadData(server,
-                                                               _self,
-                                                               buckets,
-                                                               _global_stats,
-                                                               conn_stat);
-  TRC_INFO("Starting TAP of %s", server.c_str());
-  int rc = pthread_create(handle, NULL, tap_buckets_thread, (void*)thread_data);
-  if (rc != 0)
+  pthread_mutex_lock(&work.lock);
+
+  while (next_tap(work, server, buckets))
   {
-    TRC_ERROR("Failed to create TAP thread (%d)", rc);
-    return false;
+    pthread_mutex_unlock(&work.lock);
+
+    _per_conn_stats->lock();
+    AstairePerConnectionStatistics::ConnectionRecord* conn_stat =
+      _per_conn_stats->add_connection(server, buckets);
+    _per_conn_stats->unlock();
+
+    TapBucketsThreadData tap_data(server,
+                                  _local_address,
+                                  buckets,
+                                  _global_stats,
+                                  conn_stat,
+                                  _tap_limiter,
+                                  _inject_limiter,
+                                  _inject_controller);
+    TRC_INFO("Starting TAP of %s", server.c_str());
+    tap_buckets_thread(&tap_data);
+
+    pthread_mutex_lock(&work.lock);
+    work.active_taps[server]--;
+
+    if (tap_data.success)
+    {
+      TRC_VERBOSE("Tap of %s completed successfully", server.c_str());
+    }
+    else
+    {
+      TRC_VERBOSE("Tap of %s failed", server.c_str());
+      blacklist_server(work.owl, server);
+    }
+
+    for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+         it != buckets.end();
+         ++it)
+    {
+      work.in_flight.erase(*it);
+
+      if (tap_data.success)
+      {
+        // These buckets have now been successfully streamed.
+        work.unstreamed_buckets.erase(*it);
+      }
+    }
+
+    // Find the buckets that have now been streamed from all of their
+    // replicas. These are finished with, so are removed from the OWL.
+    std::vector<uint16_t> finished;
+
+    for (OutstandingWorkList::iterator it = work.owl.begin();
+         it != work.owl.end();)
+    {
+      if ((it->second.empty()) &&
+          (work.in_flight.find(it->first) == work.in_flight.end()) &&
+          (work.unstreamed_buckets.find(it->first) == work.unstreamed_buckets.end()))
+      {
+        finished.push_back(it->first);
+        it = work.owl.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    // These buckets may now be ready to stream from their next replica (and
+    // if there's no work left, the other workers need to know that too).
+    pthread_cond_broadcast(&work.cond);
+
+    if (!finished.empty())
+    {
+      // Checkpoint the finished buckets, so that they aren't streamed again
+      // if the resync is interrupted.
+      pthread_mutex_unlock(&work.lock);
+
+      for (std::vector<uint16_t>::const_iterator it = finished.begin();
+           it != finished.end();
+           ++it)
+      {
+        write_checkpoint(*it, work.sources.at(*it));
+      }
+
+      pthread_mutex_lock(&work.lock);
+    }
   }
-  return true;
+
+  pthread_mutex_unlock(&work.lock);
 }
 
-// Wait for a single TAP to complete.
+// Pick the next set of vbuckets to TAP, and the server to TAP them from,
+// waiting for some to become ready if necessary. The vbuckets are marked as
+// in flight and the server is removed from their replica lists.
+//
+// The work lock must be held to call this function.
 //
-// The return value of this function indicates whether the TAP succeeded or
-// failed.  The `tap_server` parameter is set to the identity of the tapped
-// server if the tap was successful.
-bool Astaire::complete_single_tap(pthread_t thread_id, std::string& tap_server)
+// @returns - False if there is no work left.
+bool Astaire::next_tap(ResyncWork& work,
+                       std::string& server,
+                       std::vector<uint16_t>& buckets)
 {
-  TapBucketsThreadData* thread_data = NULL;
-  int rc = pthread_join(thread_id, (void**)&thread_data);
-
-  if (rc != 0)
+  while (true)
   {
-    TRC_ERROR("Failed to join TAP thread (%d)", rc);
-    return false;
-  }
+    if (_local_restart_generation.load() != work.restart_generation)
+    {
+      // The local memcached has restarted, so this resync is wasted. Don't
+      // start any more TAPs - the control thread will start a full resync.
+      TRC_DEBUG("Local memcached restarted - stop resyncing");
+      return false;
+    }
 
-  if (thread_data == NULL)
-  {
-    TRC_ERROR("Logical Error: TAP thread returned NULL thread data");
-    exit(2);
-  }
+    // Work out which vbuckets are ready to stream, grouped by the servers
+    // they could be streamed from. Each server's vbuckets are listed with
+    // the ones it is the first remaining replica for first, so that we stick
+    // to streaming from the primary first where that doesn't hold anything up.
+    std::map<std::string, std::vector<uint16_t>> ready;
+    size_t num_ready = 0;
 
-  tap_server = thread_data->tap_server;
-  bool success = thread_data->success;
-  delete thread_data; thread_data = NULL;
-  return success;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+      for (OutstandingWorkList::const_iterator it = work.owl.begin();
+           it != work.owl.end();
+           ++it)
+      {
+        if ((it->second.empty()) ||
+            (work.in_flight.find(it->first) != work.in_flight.end()))
+        {
+          continue;
+        }
+
+        if (pass == 0)
+        {
+          ready[it->second[0]].push_back(it->first);
+          num_ready++;
+        }
+        else
+        {
+          for (size_t ii = 1; ii < it->second.size(); ++ii)
+          {
+            ready[it->second[ii]].push_back(it->first);
+          }
+        }
+      }
+    }
+
+    // Pick the server that has the fewest TAPs running, as long as it's not
+    // already running as many as it's allowed. If there's a tie, pick the one
+    // with the most vbuckets waiting for it.
+    std::map<std::string, std::vector<uint16_t>>::iterator best = ready.end();
+    int free_taps = 0;
+
+    for (std::map<std::string, std::vector<uint16_t>>::iterator it = ready.begin();
+         it != ready.end();
+         ++it)
+    {
+      int active = work.active_taps[it->first];
+
+      if (active >= _tap_fanout)
+      {
+        continue;
+      }
+
+      free_taps += _tap_fanout - active;
+
+      if ((best == ready.end()) ||
+          (active < work.active_taps[best->first]) ||
+          ((active == work.active_taps[best->first]) &&
+           (it->second.size() > best->second.size())))
+      {
+        best = it;
+      }
+    }
+
+    if (best != ready.end())
+    {
+      // Take this worker's share of the ready vbuckets, assuming the TAPs
+      // that all the servers with ready vbuckets are still allowed will take
+      // the rest.
+      server = best->first;
+      size_t num_buckets = std::min((num_ready + free_taps - 1) / free_taps,
+                                    best->second.size());
+
+      buckets.assign(best->second.begin(), best->second.begin() + num_buckets);
+
+      for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+           it != buckets.end();
+           ++it)
+      {
+        work.in_flight.insert(*it);
+        std::vector<std::string>& replica_list = work.owl[*it];
+        replica_list.erase(std::find(replica_list.begin(),
+                                     replica_list.end(),
+                                     server));
+      }
+
+      work.active_taps[server]++;
+      return true;
+    }
+
+    if (work.in_flight.empty())
+    {
+      // Nothing is ready and nothing is in progress, so nothing more will
+      // become ready.
+      return false;
+    }
+
+    pthread_cond_wait(&work.cond, &work.lock);
+  }
 }
 
 // Remove an unreachable server from all records in the provided OWL.
@@ -778,12 +1292,17 @@ bool Astaire::owl_empty(const OutstandingWorkList& owl)
 // Should be removed once memcached can supply vbuckets on the TAP protocol.
 #include "libmemcached/memcached.h"
 uint16_t Astaire::vbucket_for_key(const std::string& key)
+{
+  return vbucket_for_key(key.data(), key.length());
+}
+
+uint16_t Astaire::vbucket_for_key(const char* key, size_t key_length)
 {
   // Hash the key and convert the hash to a vbucket.
-  int hash = memcached_generate_hash_value(key.data(),
-                                           key.length(),
+  int hash = memcached_generate_hash_value(key,
+                                           key_length,
                                            MEMCACHED_HASH_MD5);
-  int vbucket = hash & (128 - 1);
+  int vbucket = hash & (NUM_VBUCKETS - 1);
   return vbucket;
 }
 
@@ -843,7 +1362,11 @@ bool Astaire::tag_local_memcached()
                             ASTAIRE_TAG_VALUE,
                             0,
                             0);
-  return local_req_rsp(&set_req, NULL);
+
+  // Only write the tag on the connection that was used to check whether
+  // memcached was up-to-date before the resync. If that connection has been
+  // lost, memcached may have restarted since.
+  return local_req_rsp(&set_req, NULL, false);
 }
 
 
@@ -855,6 +1378,199 @@ bool Astaire::untag_local_memcached()
   return local_req_rsp(&del_req, NULL);
 }
 
+// Remove the vbuckets from the OWL that have already been resynced from the
+// same replicas, by an earlier resync that was interrupted before it finished.
+//
+// If the checkpoints can't be read, nothing is skipped.
+void Astaire::skip_checkpointed_buckets(OutstandingWorkList& owl)
+{
+  if (owl.empty())
+  {
+    return;
+  }
+
+  Memcached::ClientConnection local_conn(_local_address);
+  int rc = local_conn.connect();
+  if (rc != 0)
+  {
+    TRC_VERBOSE("Failed to connect to local server %s, error was (%d)",
+                _local_address.c_str(), rc);
+    return;
+  }
+
+  // GET the checkpoint for every vbucket in one go. The opaque of each
+  // request is the vbucket it is for.
+  std::vector<Memcached::GetReq> gets;
+  std::vector<const Memcached::BaseMessage*> reqs;
+  gets.reserve(owl.size());
+  reqs.reserve(owl.size() + 1);
+
+  for (OutstandingWorkList::const_iterator it = owl.begin();
+       it != owl.end();
+       ++it)
+  {
+    gets.push_back(Memcached::GetReq(checkpoint_key(it->first),
+                                     it->first,
+                                     (uint8_t)Memcached::OpCode::GETKQ));
+    reqs.push_back(&gets.back());
+  }
+
+  Memcached::NoopReq noop(0);
+  reqs.push_back(&noop);
+
+  if (!local_conn.send(reqs))
+  {
+    TRC_VERBOSE("Lost connection with local memcached instance");
+    return;
+  }
+
+  // Misses aren't reported, so we only get responses for the vbuckets that
+  // have checkpoints, followed by the NOOP response.
+  std::set<uint16_t> resynced;
+
+  while (true)
+  {
+    Memcached::MsgView rsp;
+    Memcached::Status status = local_conn.recv(rsp);
+    if (status != Memcached::Status::OK)
+    {
+      TRC_VERBOSE("Lost connection with local memcached instance");
+      return;
+    }
+
+    if ((!rsp.is_request()) &&
+        (rsp.op_code() == (uint8_t)Memcached::OpCode::NOOP))
+    {
+      break;
+    }
+
+    if ((rsp.is_request()) ||
+        (rsp.op_code() != (uint8_t)Memcached::OpCode::GETKQ) ||
+        (rsp.vbucket_or_status() != (uint16_t)Memcached::ResultCode::NO_ERROR))
+    {
+      continue;
+    }
+
+    // The checkpoint only counts if the vbucket was streamed from the
+    // replicas this resync would stream it from.
+    OutstandingWorkList::const_iterator it = owl.find(rsp.opaque());
+    if ((it != owl.end()) &&
+        (std::string(rsp.value(), rsp.value_length()) ==
+         checkpoint_value(it->second)))
+    {
+      resynced.insert(it->first);
+    }
+  }
+
+  if (!resynced.empty())
+  {
+    TRC_INFO("Skipping %d vbuckets that have already been resynced",
+             resynced.size());
+
+    for (std::set<uint16_t>::const_iterator it = resynced.begin();
+         it != resynced.end();
+         ++it)
+    {
+      owl.erase(*it);
+    }
+  }
+}
+
+// Record in the local memcached that a vbucket has been completely resynced
+// from the specified replicas.
+// @return - Whether the checkpoint was written successfully.
+bool Astaire::write_checkpoint(uint16_t vbucket,
+                               const std::vector<std::string>& replicas)
+{
+  std::string key = checkpoint_key(vbucket);
+  Memcached::SetReq set_req(key,
+                            vbucket_for_key(key),
+                            checkpoint_value(replicas),
+                            0,
+                            0);
+  return local_req_rsp(&set_req, NULL, false);
+}
+
+// Delete all the checkpoints from the local memcached.
+// @return - Whether the checkpoints were cleared successfully.
+bool Astaire::clear_checkpoints()
+{
+  Memcached::ClientConnection local_conn(_local_address);
+  int rc = local_conn.connect();
+  if (rc != 0)
+  {
+    TRC_VERBOSE("Failed to connect to local server %s, error was (%d)",
+                _local_address.c_str(), rc);
+    return false;
+  }
+
+  std::vector<Memcached::DeleteReq> dels;
+  std::vector<const Memcached::BaseMessage*> reqs;
+  dels.reserve(NUM_VBUCKETS);
+  reqs.reserve(NUM_VBUCKETS + 1);
+
+  for (int vbucket = 0; vbucket < NUM_VBUCKETS; ++vbucket)
+  {
+    dels.push_back(Memcached::DeleteReq(checkpoint_key(vbucket),
+                                        vbucket,
+                                        (uint8_t)Memcached::OpCode::DELETEQ));
+    reqs.push_back(&dels.back());
+  }
+
+  Memcached::NoopReq noop(0);
+  reqs.push_back(&noop);
+
+  if (!local_conn.send(reqs))
+  {
+    TRC_VERBOSE("Lost connection with local memcached instance");
+    return false;
+  }
+
+  // Only failures (mostly misses) are reported, followed by the NOOP response.
+  while (true)
+  {
+    Memcached::MsgView rsp;
+    Memcached::Status status = local_conn.recv(rsp);
+    if (status != Memcached::Status::OK)
+    {
+      TRC_VERBOSE("Lost connection with local memcached instance");
+      return false;
+    }
+
+    if ((!rsp.is_request()) &&
+        (rsp.op_code() == (uint8_t)Memcached::OpCode::NOOP))
+    {
+      return true;
+    }
+  }
+}
+
+// The key of the checkpoint record for a vbucket.
+std::string Astaire::checkpoint_key(uint16_t vbucket)
+{
+  return ASTAIRE_CHECKPOINT_KEY_PREFIX + std::to_string(vbucket);
+}
+
+// The value of a checkpoint record. This is the list of replicas the vbucket
+// was streamed from.
+std::string Astaire::checkpoint_value(const std::vector<std::string>& replicas)
+{
+  std::string value;
+
+  for (std::vector<std::string>::const_iterator it = replicas.begin();
+       it != replicas.end();
+       ++it)
+  {
+    if (it != replicas.begin())
+    {
+      value += ",";
+    }
+    value += *it;
+  }
+
+  return value;
+}
+
 // Utility function for doing a request/response cycle to the local memcached
 // node.
 //
@@ -863,6 +1579,11 @@ bool Astaire::untag_local_memcached()
 //                  response. The caller gains ownership of the response and
 //                  must delete it when they are finished with it. May be NULL
 //                  meaning the response is not passed out.
+// @param reconnect - Whether to make a new connection if the existing one has
+//                  been lost. This is false for requests that must go to the
+//                  same memcached process as earlier ones (such as writing
+//                  the tag at the end of a resync), as a lost connection means
+//                  memcached may have restarted in between.
 //
 // @return        - Whether a response of the right type has been received.
 //
@@ -870,24 +1591,85 @@ bool Astaire::untag_local_memcached()
 //                  actually successful, only whether we got the request to
 //                  memcached and got a sensible looking response.
 bool Astaire::local_req_rsp(Memcached::BaseReq* req,
-                            Memcached::BaseRsp** rsp_ptr)
+                            Memcached::BaseRsp** rsp_ptr,
+                            bool reconnect)
 {
-  // Create a connection to the local memcached.
-  Memcached::ClientConnection local_conn(_self);
-  int rc = local_conn.connect();
-  if (rc != 0)
+  pthread_mutex_lock(&_local_conn_lock);
+
+  // The connection to the local memcached is kept open between requests. If
+  // it has been dropped since it was last used (for example because memcached
+  // has restarted) we only find out when we try to use it, so in that case
+  // try again on a new connection.
+  bool success = false;
+  bool reconnected = false;
+
+  // If the monitor thread has seen memcached restart since this connection was
+  // made, the connection may still look healthy (for example if memcached has
+  // restarted but the connection has not yet been reset), so drop it rather
+  // than risk talking to the old memcached.
+  if ((_local_conn->connected()) &&
+      (_local_restart_generation.load() != _local_conn_generation))
   {
-    TRC_VERBOSE("Failed to connect to local server %s, error was (%d)",
-                _self.c_str(), rc);
-    return false;
+    TRC_DEBUG("Local memcached has restarted, dropping connection");
+    _local_conn->disconnect();
   }
 
+  while (!success)
+  {
+    if (!_local_conn->connected())
+    {
+      if (!reconnect)
+      {
+        TRC_VERBOSE("Not connected to local memcached instance");
+        break;
+      }
+
+      // Read the generation before connecting, so that if memcached restarts
+      // while we connect we reconnect again next time.
+      _local_conn_generation = _local_restart_generation.load();
+      int rc = _local_conn->connect();
+      if (rc != 0)
+      {
+        TRC_VERBOSE("Failed to connect to local server %s, error was (%d)",
+                    _local_address.c_str(), rc);
+        break;
+      }
+      reconnected = true;
+    }
+
+    if (local_conn_req_rsp(req, rsp_ptr))
+    {
+      success = true;
+    }
+    else
+    {
+      _local_conn->disconnect();
+
+      if ((reconnected) || (!reconnect))
+      {
+        // This was already a new connection, so there's no point retrying.
+        break;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_local_conn_lock);
+  return success;
+}
+
+// Do a request/response cycle on the connection to the local memcached, which
+// must be connected. The local connection lock must be held.
+//
+// See `local_req_rsp` for the meaning of the parameters and return value.
+bool Astaire::local_conn_req_rsp(Memcached::BaseReq* req,
+                                 Memcached::BaseRsp** rsp_ptr)
+{
   // Send the request on the connection.
-  local_conn.send(*req);
+  _local_conn->send(*req);
 
   // Check we get the right response back.
   Memcached::BaseMessage* base_msg = NULL;
-  Memcached::Status status = local_conn.recv(&base_msg);
+  Memcached::Status status = _local_conn->recv(&base_msg);
   if (status != Memcached::Status::OK)
   {
     TRC_VERBOSE("Lost connection with local memcached instance");
@@ -909,6 +1691,10 @@ bool Astaire::local_req_rsp(Memcached::BaseReq* req,
   {
     *rsp_ptr = (Memcached::BaseRsp*)base_msg;
   }
+  else
+  {
+    delete base_msg; base_msg = NULL;
+  }
   return true;
 }
 
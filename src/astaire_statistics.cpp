@@ -47,28 +47,37 @@ void AstaireGlobalStatistics::refreshed()
   values.push_back(std::to_string(_resynced_keys_count.load()));
   values.push_back(std::to_string(_resynced_bytes_count.load()));
   values.push_back(std::to_string(_bandwidth));
+  values.push_back(std::to_string(_throttle_level.load()));
+  values.push_back(std::to_string(_discarded_bytes_count.load()));
+  values.push_back(std::to_string(_skipped_bytes_count.load()));
   _statistic.report_change(values);
 }
 
 void AstaireGlobalStatistics::refresh(bool force)
+{
+  // Just note that the statistics have changed. They are read and reported
+  // by the reporter thread, so changing a statistic never waits for them to
+  // be published.
+  _dirty.store(true, std::memory_order_relaxed);
+}
+
+void AstaireGlobalStatistics::publish()
 {
   // Get the timestamp from the start of the current period, and the timestamp
   // now.
   uint_fast64_t timestamp_us = _timestamp_us.load();
   uint_fast64_t timestamp_us_now = get_timestamp_us();
+  bool changed = _dirty.exchange(false);
 
-  // If enough time has passed, read the new values and make the refreshed()
-  // callback.  If we're being forced, call refreshed() anyway.
-  //
-  // If we fail the CAS, someone else has just handled this tick and we can
-  // leave the reporting to them.
-  if ((timestamp_us_now >= timestamp_us + _target_period_us) &&
-      (_timestamp_us.compare_exchange_weak(timestamp_us, timestamp_us_now)))
+  // If enough time has passed, read the new values of the collated stats.
+  if (timestamp_us_now >= timestamp_us + _target_period_us)
   {
+    _timestamp_us.store(timestamp_us_now);
     read(timestamp_us_now - timestamp_us);
-    refreshed();
+    changed = true;
   }
-  else if (force)
+
+  if (changed)
   {
     refreshed();
   }
@@ -99,6 +108,8 @@ void AstaireGlobalStatistics::reset()
   _resynced_bytes_count.store(0);
   _bandwidth_raw.store(0);
   _bandwidth = 0;
+  _discarded_bytes_count.store(0);
+  _skipped_bytes_count.store(0);
   refresh(true);
 }
 
@@ -111,7 +122,7 @@ void AstaireGlobalStatistics::thread_func()
     clock_gettime(CLOCK_MONOTONIC, &next_refresh);
     next_refresh.tv_sec += 1;
     pthread_cond_timedwait(&_refresh_cond, &_refresh_mutex, &next_refresh);
-    refresh(true);
+    publish();
   }
   pthread_mutex_unlock(&_refresh_mutex);
 }
@@ -129,26 +140,60 @@ void AstairePerConnectionStatistics::refreshed()
 }
 
 void AstairePerConnectionStatistics::refresh(bool force)
+{
+  // Just note that the statistics have changed. They are read and reported
+  // by the reporter thread.
+  _dirty.store(true, std::memory_order_relaxed);
+}
+
+void AstairePerConnectionStatistics::publish()
 {
   // Get the timestamp from the start of the current period, and the timestamp
   // now.
   uint_fast64_t timestamp_us = _timestamp_us.load();
   uint_fast64_t timestamp_us_now = get_timestamp_us();
+  bool changed = _dirty.exchange(false);
 
-  // If we're forced, or this period is already long enough, read the new
-  // values and make the refreshed() callback.
-  if ((timestamp_us_now >= timestamp_us + _target_period_us) &&
-      (_timestamp_us.compare_exchange_weak(timestamp_us, timestamp_us_now)))
+  // If enough time has passed, read the new values of the collated stats.
+  if (timestamp_us_now >= timestamp_us + _target_period_us)
   {
+    _timestamp_us.store(timestamp_us_now);
     read(timestamp_us_now - timestamp_us);
-    refreshed();
+    changed = true;
   }
-  else if (force)
+
+  if (changed)
   {
     refreshed();
   }
 }
 
+void AstairePerConnectionStatistics::thread_func()
+{
+  lock();
+  while (!_terminated)
+  {
+    struct timespec next_refresh;
+    clock_gettime(CLOCK_MONOTONIC, &next_refresh);
+    next_refresh.tv_sec += 1;
+    pthread_cond_timedwait(&_refresh_cond, &_lock, &next_refresh);
+
+    // Pick up the keys the TAP threads have resynced since the last tick,
+    // then report the stats if anything has changed.
+    for (std::vector<ConnectionRecord*>::iterator it = _connections.begin();
+         it != _connections.end();
+         ++it)
+    {
+      if ((*it)->fold())
+      {
+        refresh(false);
+      }
+    }
+    publish();
+  }
+  unlock();
+}
+
 void AstairePerConnectionStatistics::read(uint_fast64_t period_us)
 {
   for (std::vector<ConnectionRecord*>::iterator it = _connections.begin();
@@ -162,6 +207,22 @@ void AstairePerConnectionStatistics::read(uint_fast64_t period_us)
 void AstairePerConnectionStatistics::reset()
 {
   _timestamp_us.store(get_timestamp_us());
+
+  // Pick up any keys resynced since the reporter thread's last tick, and
+  // report them before the records are thrown away.
+  bool changed = false;
+  for (std::vector<ConnectionRecord*>::iterator it = _connections.begin();
+       it != _connections.end();
+       ++it)
+  {
+    changed = (*it)->fold() || changed;
+  }
+
+  if (changed)
+  {
+    refreshed();
+  }
+
   for (std::vector<ConnectionRecord*>::iterator it = _connections.begin();
        it != _connections.end();
        ++it)
@@ -215,6 +276,36 @@ void AstairePerConnectionStatistics::ConnectionRecord::read(uint_fast64_t period
   }
 }
 
+bool AstairePerConnectionStatistics::ConnectionRecord::fold()
+{
+  bool changed = false;
+
+  for (std::map<uint16_t, BucketRecord*>::iterator it = _bucket_map.begin();
+       it != _bucket_map.end();
+       ++it)
+  {
+    uint16_t bucket = it->first;
+    if (bucket >= _tap_keys.size())
+    {
+      continue;
+    }
+
+    uint32_t keys = _tap_keys[bucket].load(std::memory_order_relaxed);
+    uint32_t bytes = _tap_bytes[bucket].load(std::memory_order_relaxed);
+
+    if ((keys != _folded_keys[bucket]) || (bytes != _folded_bytes[bucket]))
+    {
+      it->second->add_resynced(keys - _folded_keys[bucket],
+                               bytes - _folded_bytes[bucket]);
+      _folded_keys[bucket] = keys;
+      _folded_bytes[bucket] = bytes;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
 void AstairePerConnectionStatistics::ConnectionRecord::reset()
 {
   for (std::map<uint16_t, BucketRecord*>::iterator it = _bucket_map.begin();
@@ -267,6 +358,14 @@ void AstairePerConnectionStatistics::BucketRecord::read(uint_fast64_t period_us)
   }
 }
 
+void AstairePerConnectionStatistics::BucketRecord::add_resynced(uint32_t keys,
+                                                                uint32_t bytes)
+{
+  _resynced_keys_count.fetch_add(keys);
+  _resynced_bytes_count.fetch_add(bytes);
+  _bandwidth_raw.fetch_add(bytes);
+}
+
 void AstairePerConnectionStatistics::BucketRecord::reset()
 {
   _resynced_keys_count.store(0);
@@ -51,6 +51,7 @@
 struct options
 {
   std::string local_memcached_server;
+  std::string local_memcached_socket;
   std::string cluster_settings_file;
   std::string bind_addr;
   bool log_to_file;
@@ -58,29 +59,56 @@ struct options
   int log_level;
   std::string pidfile;
   bool daemon;
+  int max_item_size;
+  int tap_fanout;
+  int tap_bandwidth_limit;
+  int inject_rate_limit;
+  int inject_latency_target;
+  bool inject_latency_target_set;
+  int backend_connections;
+  int hedge_read_percentile;
+  int hedge_read_limit;
 };
 
 enum Options
 {
   LOCAL_NAME=256+1,
+  LOCAL_MEMCACHED_SOCKET,
   CLUSTER_SETTINGS_FILE,
   BIND_ADDR,
   LOG_FILE,
   LOG_LEVEL,
   PIDFILE,
   DAEMON,
+  MAX_ITEM_SIZE,
+  TAP_FANOUT,
+  TAP_BANDWIDTH_LIMIT,
+  INJECT_RATE_LIMIT,
+  INJECT_LATENCY_TARGET,
+  BACKEND_CONNECTIONS,
+  HEDGE_READ_PERCENTILE,
+  HEDGE_READ_LIMIT,
   HELP,
 };
 
 const static struct option long_opt[] =
 {
   {"local-name",             required_argument, NULL, LOCAL_NAME},
+  {"local-memcached-socket", required_argument, NULL, LOCAL_MEMCACHED_SOCKET},
   {"cluster-settings-file",  required_argument, NULL, CLUSTER_SETTINGS_FILE},
   {"bind-addr",              required_argument, NULL, BIND_ADDR},
   {"log-file",               required_argument, NULL, LOG_FILE},
   {"log-level",              required_argument, NULL, LOG_LEVEL},
   {"pidfile",                required_argument, NULL, PIDFILE},
   {"daemon",                 no_argument,       NULL, DAEMON},
+  {"max-item-size",          required_argument, NULL, MAX_ITEM_SIZE},
+  {"tap-fanout",             required_argument, NULL, TAP_FANOUT},
+  {"tap-bandwidth-limit",    required_argument, NULL, TAP_BANDWIDTH_LIMIT},
+  {"inject-rate-limit",      required_argument, NULL, INJECT_RATE_LIMIT},
+  {"inject-latency-target",  required_argument, NULL, INJECT_LATENCY_TARGET},
+  {"backend-connections",    required_argument, NULL, BACKEND_CONNECTIONS},
+  {"hedge-read-percentile",  required_argument, NULL, HEDGE_READ_PERCENTILE},
+  {"hedge-read-limit",       required_argument, NULL, HEDGE_READ_LIMIT},
   {"help",                   no_argument,       NULL, HELP},
   {NULL,                     0,                 NULL, 0},
 };
@@ -92,6 +120,10 @@ void usage(void)
   puts("Options:\n"
        "\n"
        " --local-name <hostname>    Specify the name of the local memcached server\n"
+       " --local-memcached-socket=<path>\n"
+       "                            Connect to the local memcached server over the\n"
+       "                            Unix domain socket with this path, rather than\n"
+       "                            to the address given by --local-name\n"
        " --cluster-settings-file=<filename>\n"
        "                            The filename of the cluster settings file\n"
        " --bind-addr=<IP>           The IP address to bind to (default: all)\n"
@@ -99,6 +131,34 @@ void usage(void)
        " --log-level=N              Set log level to N (default: 4)\n"
        " --pidfile=<filename>       Write pidfile\n"
        " --daemon                   Run as daemon\n"
+       " --max-item-size=<bytes>    The largest value that will be accepted from a\n"
+       "                            client or resynced from another node\n"
+       "                            (default: 1048576)\n"
+       " --tap-fanout=N             The number of parallel TAP connections to make to\n"
+       "                            each server when resyncing (default: 1)\n"
+       " --tap-bandwidth-limit=<bytes>\n"
+       "                            The most bytes per second to receive over TAP\n"
+       "                            when resyncing, or 0 for no limit\n"
+       "                            (default: 10485760)\n"
+       " --inject-rate-limit=N      The most records per second to inject into the\n"
+       "                            local memcached when resyncing, or 0 for no\n"
+       "                            limit (default: 10000)\n"
+       " --inject-latency-target=<microseconds>\n"
+       "                            The 99th percentile latency of the local\n"
+       "                            memcached to aim for when resyncing. The\n"
+       "                            injection rate is reduced below its limit\n"
+       "                            while this is exceeded, or 0 to never reduce it\n"
+       "                            (default: 10000, or 0 if there is no injection\n"
+       "                            rate limit)\n"
+       " --backend-connections=N    The number of connections the proxy makes to\n"
+       "                            each memcached server, shared between all\n"
+       "                            client connections (default: 8)\n"
+       " --hedge-read-percentile=N  If a memcached server hasn't answered a read\n"
+       "                            within the Nth percentile of its recent\n"
+       "                            response times, read from the next replica\n"
+       "                            instead, or 0 to never do this (default: 0)\n"
+       " --hedge-read-limit=N       The most reads to hedge in this way, as a\n"
+       "                            percentage of all reads (default: 5)\n"
        " --help                     Show this help screen\n"
        );
 }
@@ -150,6 +210,10 @@ int init_options(int argc, char**argv, struct options& options)
       options.local_memcached_server = optarg;
       break;
 
+    case LOCAL_MEMCACHED_SOCKET:
+      options.local_memcached_socket = optarg;
+      break;
+
     case CLUSTER_SETTINGS_FILE:
       options.cluster_settings_file = optarg;
       break;
@@ -162,6 +226,39 @@ int init_options(int argc, char**argv, struct options& options)
       options.pidfile = std::string(optarg);
       break;
 
+    case MAX_ITEM_SIZE:
+      options.max_item_size = atoi(optarg);
+      break;
+
+    case TAP_FANOUT:
+      options.tap_fanout = atoi(optarg);
+      break;
+
+    case TAP_BANDWIDTH_LIMIT:
+      options.tap_bandwidth_limit = atoi(optarg);
+      break;
+
+    case INJECT_RATE_LIMIT:
+      options.inject_rate_limit = atoi(optarg);
+      break;
+
+    case INJECT_LATENCY_TARGET:
+      options.inject_latency_target = atoi(optarg);
+      options.inject_latency_target_set = true;
+      break;
+
+    case BACKEND_CONNECTIONS:
+      options.backend_connections = atoi(optarg);
+      break;
+
+    case HEDGE_READ_PERCENTILE:
+      options.hedge_read_percentile = atoi(optarg);
+      break;
+
+    case HEDGE_READ_LIMIT:
+      options.hedge_read_limit = atoi(optarg);
+      break;
+
     case HELP:
       usage();
       CL_ASTAIRE_ENDED.log();
@@ -226,10 +323,20 @@ int main(int argc, char** argv)
   options.log_level = 0;
   options.log_directory = "";
   options.local_memcached_server = "";
+  options.local_memcached_socket = "";
   options.cluster_settings_file = "";
   options.bind_addr = "";
   options.pidfile = "";
   options.daemon = false;
+  options.max_item_size = Memcached::Connection::DEFAULT_MAX_ITEM_SIZE;
+  options.tap_fanout = Astaire::DEFAULT_TAP_FANOUT;
+  options.tap_bandwidth_limit = Astaire::DEFAULT_TAP_BANDWIDTH_LIMIT;
+  options.inject_rate_limit = Astaire::DEFAULT_INJECT_RATE_LIMIT;
+  options.inject_latency_target = Astaire::DEFAULT_INJECT_LATENCY_TARGET_US;
+  options.inject_latency_target_set = false;
+  options.backend_connections = MemcachedBackend::DEFAULT_CONNECTIONS_PER_SERVER;
+  options.hedge_read_percentile = 0;
+  options.hedge_read_limit = MemcachedBackend::DEFAULT_MAX_HEDGE_PERCENT;
 
   // Initialise ENT logging before making "Started" log
   PDLogStatic::init(argv[0]);
@@ -268,12 +375,77 @@ int main(int argc, char** argv)
     return 2;
   }
 
+  if ((options.local_memcached_socket != "") &&
+      (options.local_memcached_socket[0] != '/'))
+  {
+    TRC_ERROR("Local memcached socket must be an absolute path");
+    return 2;
+  }
+
   if (options.cluster_settings_file == "")
   {
     TRC_ERROR("Must supply cluster settings file");
     return 2;
   }
 
+  if (options.max_item_size <= 0)
+  {
+    TRC_ERROR("Maximum item size must be positive");
+    return 2;
+  }
+
+  Memcached::Connection::set_max_item_size(options.max_item_size);
+
+  if (options.tap_fanout <= 0)
+  {
+    TRC_ERROR("TAP fan-out must be positive");
+    return 2;
+  }
+
+  if ((options.tap_bandwidth_limit < 0) || (options.inject_rate_limit < 0))
+  {
+    TRC_ERROR("Resync rate limits must not be negative");
+    return 2;
+  }
+
+  if (options.inject_latency_target < 0)
+  {
+    TRC_ERROR("Injection latency target must not be negative");
+    return 2;
+  }
+
+  // The latency target works by reducing the injection rate below its limit,
+  // so it has no effect if there is no limit.
+  if (options.inject_rate_limit == 0)
+  {
+    if ((options.inject_latency_target_set) &&
+        (options.inject_latency_target != 0))
+    {
+      TRC_ERROR("Injection latency target requires an injection rate limit");
+      return 2;
+    }
+
+    options.inject_latency_target = 0;
+  }
+
+  if (options.backend_connections <= 0)
+  {
+    TRC_ERROR("Number of backend connections must be positive");
+    return 2;
+  }
+
+  if ((options.hedge_read_percentile < 0) || (options.hedge_read_percentile >= 100))
+  {
+    TRC_ERROR("Hedged read percentile must be between 0 and 99");
+    return 2;
+  }
+
+  if ((options.hedge_read_limit < 0) || (options.hedge_read_limit > 100))
+  {
+    TRC_ERROR("Hedged read limit must be between 0 and 100");
+    return 2;
+  }
+
   TRC_STATUS("Astaire starting up");
 
   if (options.pidfile != "")
@@ -310,8 +482,8 @@ int main(int argc, char** argv)
   }
 
   // Create statistics infrastructure.
-  std::string stats[] = { "astaire_global", "astaire_connections" };
-  LastValueCache* lvc = new LastValueCache(2, stats, "astaire");
+  std::string stats[] = { "astaire_global", "astaire_connections", "astaire_replicas" };
+  LastValueCache* lvc = new LastValueCache(3, stats, "astaire");
   AstaireGlobalStatistics* global_stats = new AstaireGlobalStatistics(lvc);
   AstairePerConnectionStatistics* per_conn_stats = new AstairePerConnectionStatistics(lvc);
 
@@ -330,7 +502,15 @@ int main(int argc, char** argv)
 
   MemcachedBackend* backend = new MemcachedBackend(view_cfg,
                                                    memcached_comm_monitor,
-                                                   vbucket_alarm);
+                                                   vbucket_alarm,
+                                                   options.backend_connections,
+                                                   lvc);
+
+  if ((options.hedge_read_percentile > 0) && (options.hedge_read_limit > 0))
+  {
+    backend->enable_hedged_reads(options.hedge_read_percentile,
+                                 options.hedge_read_limit);
+  }
 
   // Start the memcached proxy server.
   ProxyServer* proxy_server = new ProxyServer(backend);
@@ -347,7 +527,12 @@ int main(int argc, char** argv)
                                  astaire_resync_alarm,
                                  global_stats,
                                  per_conn_stats,
-                                 options.local_memcached_server);
+                                 options.local_memcached_server,
+                                 options.tap_fanout,
+                                 options.tap_bandwidth_limit,
+                                 options.inject_rate_limit,
+                                 options.inject_latency_target,
+                                 options.local_memcached_socket);
 
   sem_wait(&term_sem);
 
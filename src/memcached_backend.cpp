@@ -53,31 +53,35 @@
 #include "log.h"
 #include "utils.h"
 #include "updater.h"
+#include "statistic.h"
 #include "memcachedstoreview.h"
 #include "memcached_backend.hpp"
 
 
 MemcachedBackend::MemcachedBackend(MemcachedConfigReader* config_reader,
                                    BaseCommunicationMonitor* comm_monitor,
-                                   Alarm* vbucket_alarm) :
+                                   Alarm* vbucket_alarm,
+                                   int connections_per_server,
+                                   LastValueCache* lvc) :
   _updater(NULL),
   _replicas(2),
   _vbuckets(128),
   _options(),
-  _view_number(0),
+  _connections_per_server(connections_per_server),
   _servers(),
+  _view(),
+  _hedge_policy(NULL),
   _max_connect_latency_ms(50),
-  _read_replicas(_vbuckets),
-  _write_replicas(_vbuckets),
   _comm_monitor(comm_monitor),
   _vbucket_comm_state(_vbuckets),
   _vbucket_comm_fail_count(0),
   _vbucket_alarm(vbucket_alarm),
-  _config_reader(config_reader)
+  _config_reader(config_reader),
+  _replica_statistic(NULL),
+  _replica_stats(),
+  _stats_terminated(false),
+  _prober_terminated(false)
 {
-  // Create the thread local key for the per thread data.
-  pthread_key_create(&_thread_local, MemcachedBackend::cleanup_connection);
-
   // Create the lock for protecting the current view.
   pthread_rwlock_init(&_view_lock, NULL);
 
@@ -88,7 +92,14 @@ MemcachedBackend::MemcachedBackend(MemcachedConfigReader* config_reader,
   // timeout because libmemcached tries to connect to all servers sequentially
   // during start-up, and if any are not up we don't want to wait for any
   // significant length of time.
-  _options = "--CONNECT-TIMEOUT=10 --SUPPORT-CAS --POLL-TIMEOUT=250 --BINARY-PROTOCOL";
+  _options = "--CONNECT-TIMEOUT=10 --SUPPORT-CAS --POLL-TIMEOUT=" +
+             std::to_string(POLL_TIMEOUT_MS) + " --BINARY-PROTOCOL";
+
+  // Start with an empty view, so requests fail cleanly until the cluster
+  // settings have been read.
+  _view.reset(new View);
+  _view->read_replicas.resize(_vbuckets);
+  _view->write_replicas.resize(_vbuckets);
 
   // Create an updater to keep the store configured appropriately.
   _updater = new Updater<void, MemcachedBackend>(this, std::mem_fun(&MemcachedBackend::update_config));
@@ -98,6 +109,45 @@ MemcachedBackend::MemcachedBackend(MemcachedConfigReader* config_reader,
   {
     _vbucket_comm_state[ii] = OK;
   }
+
+  // Start reporting the state of the write-behind queues, if we've been given
+  // somewhere to report it.
+  pthread_mutex_init(&_stats_lock, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_stats_cond, &cond_attr);
+  pthread_mutex_init(&_prober_lock, NULL);
+  pthread_cond_init(&_prober_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (lvc != NULL)
+  {
+    _replica_statistic = new Statistic("astaire_replicas", lvc);
+
+    int rc = pthread_create(&_stats_thread,
+                            NULL,
+                            MemcachedBackend::stats_thread_entry_point,
+                            this);
+    if (rc != 0)
+    {
+      TRC_ERROR("Replica stats thread creation failed (%d)", rc);
+      delete _replica_statistic; _replica_statistic = NULL;
+    }
+  }
+
+  // Start probing servers that have failed.
+  int rc = pthread_create(&_prober_thread,
+                          NULL,
+                          MemcachedBackend::prober_thread_entry_point,
+                          this);
+  if (rc != 0)
+  {
+    // Servers whose circuit opens will only be used again when a request
+    // that has no other replica to try succeeds on them.
+    TRC_ERROR("Prober thread creation failed (%d)", rc);
+    _prober_terminated = true;
+  }
 }
 
 
@@ -106,21 +156,42 @@ MemcachedBackend::~MemcachedBackend()
   // Destroy the updater.
   delete _updater; _updater = NULL;
 
-  // Clean up this thread's connection now, rather than waiting for
-  // pthread_exit.  This is to support use by single-threaded code
-  // (e.g., UTs), where pthread_exit is never called.
-  connection* conn = (connection*)pthread_getspecific(_thread_local);
-  if (conn != NULL)
+  if (_replica_statistic != NULL)
+  {
+    pthread_mutex_lock(&_stats_lock);
+    _stats_terminated = true;
+    pthread_cond_signal(&_stats_cond);
+    pthread_mutex_unlock(&_stats_lock);
+    pthread_join(_stats_thread, NULL);
+
+    delete _replica_statistic; _replica_statistic = NULL;
+  }
+
+  pthread_cond_destroy(&_stats_cond);
+  pthread_mutex_destroy(&_stats_lock);
+
+  pthread_mutex_lock(&_prober_lock);
+  bool prober_running = !_prober_terminated;
+  _prober_terminated = true;
+  pthread_cond_signal(&_prober_cond);
+  pthread_mutex_unlock(&_prober_lock);
+
+  if (prober_running)
   {
-    pthread_setspecific(_thread_local, NULL);
-    cleanup_connection(conn);
+    pthread_join(_prober_thread, NULL);
   }
 
+  pthread_cond_destroy(&_prober_cond);
+  pthread_mutex_destroy(&_prober_lock);
+
+  // Drop the current view, which frees its connections.
+  _view.reset();
+
+  delete _hedge_policy; _hedge_policy = NULL;
+
   pthread_mutex_destroy(&_vbucket_comm_lock);
 
   pthread_rwlock_destroy(&_view_lock);
-
-  pthread_key_delete(_thread_local);
 }
 
 
@@ -130,6 +201,15 @@ void MemcachedBackend::set_max_connect_latency(unsigned int ms)
   _max_connect_latency_ms = ms;
 }
 
+void MemcachedBackend::enable_hedged_reads(unsigned int percentile,
+                                           unsigned int max_hedge_percent)
+{
+  TRC_STATUS("Hedging reads after %dth percentile response time, for at most %d%% of reads",
+             percentile, max_hedge_percent);
+  delete _hedge_policy;
+  _hedge_policy = new HedgePolicy(percentile, max_hedge_percent, POLL_TIMEOUT_MS);
+}
+
 /// Set up a new view of the memcached cluster(s).  The view determines
 /// how data is distributed around the cluster.
 void MemcachedBackend::new_view(const MemcachedConfig& config)
@@ -140,24 +220,64 @@ void MemcachedBackend::new_view(const MemcachedConfig& config)
   MemcachedStoreView view(_vbuckets, _replicas);
   view.update(config);
 
-  // Now copy the view so it can be accessed by the worker threads.
-  pthread_rwlock_wrlock(&_view_lock);
+  // Build the connection pools and replica tables for the new view.  This is
+  // done before taking the lock so that worker threads can carry on using
+  // the old view while the new pools are connected.  Servers that are in the
+  // old view keep their existing pools, so only the connections to servers
+  // that have been added are made here, and only those to servers that have
+  // been removed are closed (once the old view is no longer in use).
+  std::shared_ptr<View> old_view = current_view();
+  std::shared_ptr<View> next_view(new View);
+  std::vector<std::string> servers = view.servers();
+
+  for (size_t ii = 0; ii < servers.size(); ++ii)
+  {
+    std::map<std::string, std::shared_ptr<ServerPool> >::const_iterator it =
+      old_view->pools.find(servers[ii]);
 
-  // Get the list of servers from the view.
-  _servers = view.servers();
+    if (it != old_view->pools.end())
+    {
+      TRC_DEBUG("Reusing connections to server %s", servers[ii].c_str());
+      next_view->pools[servers[ii]] = it->second;
+    }
+    else
+    {
+      TRC_DEBUG("Adding connections to server %s", servers[ii].c_str());
+      std::shared_ptr<ServerPool> pool(new ServerPool(servers[ii],
+                                                      _options,
+                                                      _max_connect_latency_ms,
+                                                      _connections_per_server));
+      pool->warm();
+      next_view->pools[servers[ii]] = pool;
+    }
+  }
+
+  old_view.reset();
+
+  next_view->read_replicas.resize(_vbuckets);
+  next_view->write_replicas.resize(_vbuckets);
 
-  // For each vbucket, get the list of read replicas and write replicas.
   for (int ii = 0; ii < _vbuckets; ++ii)
   {
-    _read_replicas[ii] = view.read_replicas(ii);
-    _write_replicas[ii] = view.write_replicas(ii);
+    const std::vector<std::string>& read_replicas = view.read_replicas(ii);
+    for (size_t jj = 0; jj < read_replicas.size(); ++jj)
+    {
+      next_view->read_replicas[ii].push_back(next_view->pools[read_replicas[jj]].get());
+    }
+
+    const std::vector<std::string>& write_replicas = view.write_replicas(ii);
+    for (size_t jj = 0; jj < write_replicas.size(); ++jj)
+    {
+      next_view->write_replicas[ii].push_back(next_view->pools[write_replicas[jj]].get());
+    }
   }
 
-  // Update the view number as the last thing here, otherwise we could stall
-  // other threads waiting for the lock.
+  // Now switch the worker threads over to the new view.  The old view is
+  // freed once the last request using it has finished.
   TRC_STATUS("Finished preparing new view, so flag that workers should switch to it");
-  ++_view_number;
-
+  pthread_rwlock_wrlock(&_view_lock);
+  _servers = servers;
+  _view.swap(next_view);
   pthread_rwlock_unlock(&_view_lock);
 }
 
@@ -188,115 +308,609 @@ int MemcachedBackend::vbucket_for_key(const std::string& key)
 }
 
 
+/// Returns the current view of the cluster.  The caller must keep hold of the
+/// returned pointer for as long as it uses any of the view's connection pools.
+std::shared_ptr<MemcachedBackend::View> MemcachedBackend::current_view()
+{
+  pthread_rwlock_rdlock(&_view_lock);
+  std::shared_ptr<View> view = _view;
+  pthread_rwlock_unlock(&_view_lock);
+  return view;
+}
+
+
+const std::vector<MemcachedBackend::ServerPool*>&
+MemcachedBackend::healthy_first(const std::vector<ServerPool*>& replicas,
+                                std::vector<ServerPool*>& reordered)
+{
+  bool all_healthy = true;
+  for (size_t ii = 0; ii < replicas.size(); ++ii)
+  {
+    all_healthy = all_healthy && replicas[ii]->healthy();
+  }
+
+  if (all_healthy)
+  {
+    return replicas;
+  }
+
+  reordered.clear();
+  for (size_t ii = 0; ii < replicas.size(); ++ii)
+  {
+    if (replicas[ii]->healthy())
+    {
+      reordered.push_back(replicas[ii]);
+    }
+  }
+  for (size_t ii = 0; ii < replicas.size(); ++ii)
+  {
+    if (!replicas[ii]->healthy())
+    {
+      reordered.push_back(replicas[ii]);
+    }
+  }
+
+  return reordered;
+}
+
+
 /// Gets the set of replicas to use for a read or write operation for the
 /// specified key.
-const std::vector<memcached_st*>&
-MemcachedBackend::get_replicas(const std::string& key, Op operation)
+const std::vector<MemcachedBackend::ServerPool*>&
+MemcachedBackend::get_replicas(const View& view,
+                               const std::string& key,
+                               Op operation)
 {
-  return get_replicas(vbucket_for_key(key), operation);
+  return get_replicas(view, vbucket_for_key(key), operation);
 }
 
 
 /// Gets the set of replicas to use for a read or write operation for the
 /// specified vbucket.
-const std::vector<memcached_st*>& MemcachedBackend::get_replicas(int vbucket,
-                                                                   Op operation)
-{
-  MemcachedBackend::connection* conn = (connection*)pthread_getspecific(_thread_local);
-  if (conn == NULL)
-  {
-    // Create a new connection structure for this thread.
-    conn = new MemcachedBackend::connection;
-    pthread_setspecific(_thread_local, conn);
-    conn->view_number = 0;
-  }
-
-  if (conn->view_number != _view_number)
-  {
-    // Either the view has changed or has not yet been set up, so set up the
-    // connection and replica structures for this thread.
-    for (std::map<std::string, memcached_st*>::iterator it = conn->st.begin();
-         it != conn->st.end();
-         it++)
-    {
-      memcached_free(it->second);
-      it->second = NULL;
-    }
-    pthread_rwlock_rdlock(&_view_lock);
-
-    TRC_DEBUG("Set up new view %d for thread", _view_number);
-
-    // Create a set of memcached_st's one per server.
-    for (size_t ii = 0; ii < _servers.size(); ++ii)
-    {
-      // Create a new memcached_st for this server.  Do not specify the server
-      // at this point as memcached() does not support IPv6 addresses.
-      TRC_DEBUG("Setting up server %d for connection %p (%s)", ii, conn, _options.c_str());
-      conn->st[_servers[ii]] = memcached(_options.c_str(), _options.length());
-      TRC_DEBUG("Set up connection %p to server %s", conn->st[_servers[ii]], _servers[ii].c_str());
-
-      // Switch to a longer connect timeout from here on.
-      memcached_behavior_set(conn->st[_servers[ii]], MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, _max_connect_latency_ms);
-
-      // Disable Nagle's algorithm
-      // (https://en.wikipedia.org/wiki/Nagle%27s_algorithm). If we leave it on
-      // there can be up to 500ms delay between this code sending an
-      // asynchronous SET and it actually being sent on the wire, e.g.
-      //
-      // * Ask libmemcached to do async SET.
-      // * Async SET sent on the wire.
-      // * Ask libmemcached to do a 2nd async SET.
-      // * Up to 500ms passes.
-      // * TCP stack receives ACK to 1st SET (may be delayed because the server
-      //   does not send a protocol level response to the async SET).
-      // * 2nd async SET sent on the wire (up to 500ms late).
-      //
-      // This delay can open up window conditions in failure scenarios. In
-      // addition there is not much point in using Nagle. libmemcached's buffers
-      // are large enough that it will never send small message fragments, and
-      // this store's implementation means we very rarely pipeline requests.
-      memcached_behavior_set(conn->st[_servers[ii]], MEMCACHED_BEHAVIOR_TCP_NODELAY, true);
-
-      std::string server;
-      int port;
-      if (Utils::split_host_port(_servers[ii], server, port))
+const std::vector<MemcachedBackend::ServerPool*>&
+MemcachedBackend::get_replicas(const View& view, int vbucket, Op operation)
+{
+  return (operation == Op::READ) ? view.read_replicas[vbucket] : view.write_replicas[vbucket];
+}
+
+
+MemcachedBackend::ServerPool::ServerPool(const std::string& server,
+                                         const std::string& options,
+                                         unsigned int connect_timeout_ms,
+                                         size_t max_connections) :
+  _server(server),
+  _options(options),
+  _connect_timeout_ms(connect_timeout_ms),
+  _max_connections(max_connections),
+  _num_connections(0),
+  _idle(),
+  _write_queue(),
+  _write_queue_bytes(0),
+  _write_batch(),
+  _write_in_flight_ms(0),
+  _writes_overflowed(0),
+  _queue_overflowing(false),
+  _batches_failed(0),
+  _batches_failing(false),
+  _writer_started(false),
+  _terminated(false),
+  _circuit_state(CLOSED),
+  _consecutive_failures(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+  pthread_mutex_init(&_write_lock, NULL);
+  pthread_cond_init(&_write_cond, NULL);
+  pthread_cond_init(&_write_done_cond, NULL);
+
+  int rc = pthread_create(&_writer_thread,
+                          NULL,
+                          ServerPool::writer_thread_entry_point,
+                          this);
+  if (rc == 0)
+  {
+    _writer_started = true;
+  }
+  else
+  {
+    TRC_ERROR("Failed to create writer thread for %s (%d), so writes to it will be sent synchronously",
+              _server.c_str(),
+              rc);
+  }
+}
+
+
+MemcachedBackend::ServerPool::~ServerPool()
+{
+  // Stop the writer thread.  It sends any writes still queued first, unless
+  // the server can't be reached.
+  pthread_mutex_lock(&_write_lock);
+  _terminated = true;
+  pthread_cond_signal(&_write_cond);
+  pthread_mutex_unlock(&_write_lock);
+
+  if (_writer_started)
+  {
+    pthread_join(_writer_thread, NULL);
+  }
+
+  // A pool is only destroyed once no view that uses it is in use, so all the
+  // connections have been checked back in by now.
+  for (size_t ii = 0; ii < _idle.size(); ++ii)
+  {
+    memcached_free(_idle[ii]);
+  }
+  _idle.clear();
+
+  pthread_cond_destroy(&_write_done_cond);
+  pthread_cond_destroy(&_write_cond);
+  pthread_mutex_destroy(&_write_lock);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+memcached_st* MemcachedBackend::ServerPool::checkout()
+{
+  memcached_st* st = NULL;
+  bool create = false;
+
+  pthread_mutex_lock(&_lock);
+
+  while ((_idle.empty()) && (_num_connections >= _max_connections))
+  {
+    TRC_DEBUG("All %d connections to %s are in use, waiting",
+              _num_connections, _server.c_str());
+    pthread_cond_wait(&_cond, &_lock);
+  }
+
+  if (!_idle.empty())
+  {
+    st = _idle.back();
+    _idle.pop_back();
+  }
+  else
+  {
+    // Reserve the slot now, but create the connection outside the lock.
+    ++_num_connections;
+    create = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (create)
+  {
+    st = create_connection();
+  }
+
+  return st;
+}
+
+
+void MemcachedBackend::ServerPool::checkin(memcached_st* st)
+{
+  pthread_mutex_lock(&_lock);
+  _idle.push_back(st);
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void MemcachedBackend::ServerPool::warm()
+{
+  TRC_DEBUG("Warming %d connections to %s", _max_connections, _server.c_str());
+
+  std::vector<memcached_st*> connections;
+  for (size_t ii = 0; ii < _max_connections; ++ii)
+  {
+    connections.push_back(checkout());
+  }
+
+  for (size_t ii = 0; ii < connections.size(); ++ii)
+  {
+    // libmemcached connects lazily, so send a request to force the connection
+    // to be made.  If the server is down this fails quickly (we've set a short
+    // connect timeout) and the connection is retried when it's first used.
+    memcached_return_t rc = memcached_version(connections[ii]);
+
+    if ((ii == 0) && (!memcached_success(rc)))
+    {
+      TRC_WARNING("Failed to connect to %s (%s)",
+                  _server.c_str(),
+                  memcached_strerror(connections[ii], rc));
+      checkin(connections[ii]);
+      for (size_t jj = 1; jj < connections.size(); ++jj)
       {
-        TRC_DEBUG("Setting server to IP address %s port %d",
-                  server.c_str(),
-                  port);
-        memcached_server_add(conn->st[_servers[ii]], server.c_str(), port);
+        checkin(connections[jj]);
       }
-      else
+      return;
+    }
+
+    checkin(connections[ii]);
+  }
+}
+
+
+void MemcachedBackend::ServerPool::record_result(memcached_return_t rc)
+{
+  if ((memcached_success(rc)) ||
+      (rc == MEMCACHED_NOTFOUND) ||
+      (rc == MEMCACHED_NOTSTORED) ||
+      (rc == MEMCACHED_DATA_EXISTS))
+  {
+    // The server answered.
+    if (_consecutive_failures.load(std::memory_order_relaxed) != 0)
+    {
+      _consecutive_failures.store(0, std::memory_order_relaxed);
+    }
+
+    if (_circuit_state.load() != CLOSED)
+    {
+      if (_circuit_state.exchange(CLOSED) != CLOSED)
       {
-        TRC_ERROR("Malformed host/port %s, skipping server", _servers[ii].c_str());
+        TRC_STATUS("Memcached server %s has recovered", _server.c_str());
       }
     }
+  }
+  else if (++_consecutive_failures >= FAILURE_THRESHOLD)
+  {
+    int expected = CLOSED;
+    if (_circuit_state.compare_exchange_strong(expected, OPEN))
+    {
+      TRC_WARNING("%d requests in a row to memcached server %s have failed, avoiding it until it recovers",
+                  FAILURE_THRESHOLD,
+                  _server.c_str());
+    }
+  }
+}
+
+
+void MemcachedBackend::ServerPool::probe()
+{
+  int expected = OPEN;
+  if (!_circuit_state.compare_exchange_strong(expected, HALF_OPEN))
+  {
+    return;
+  }
+
+  // Use a new connection, so the probe doesn't have to wait for one of the
+  // pool's connections, and doesn't reuse one that's broken.
+  memcached_st* st = create_connection();
+  memcached_return_t rc = memcached_version(st);
+  memcached_free(st);
+
+  if (memcached_success(rc))
+  {
+    _consecutive_failures.store(0);
+    expected = HALF_OPEN;
+    if (_circuit_state.compare_exchange_strong(expected, CLOSED))
+    {
+      TRC_STATUS("Memcached server %s has recovered", _server.c_str());
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Memcached server %s is still failing (%d)", _server.c_str(), rc);
+    expected = HALF_OPEN;
+    _circuit_state.compare_exchange_strong(expected, OPEN);
+  }
+}
+
+
+void MemcachedBackend::ServerPool::write_behind(const std::string& key,
+                                                const std::string& data,
+                                                int vbucket,
+                                                int expiry,
+                                                uint32_t flags)
+{
+  if (!_writer_started)
+  {
+    // There's no writer thread to send the write, so send it now.
+    send_now(key, data, vbucket, expiry, flags);
+    return;
+  }
+
+  size_t bytes = key.length() + data.length();
+
+  pthread_mutex_lock(&_write_lock);
+
+  if (_write_queue_bytes + bytes > MAX_WRITE_BEHIND_BYTES)
+  {
+    // The server isn't keeping up, so rather than lose the write, send it
+    // now on a pooled connection.  Only log the first write that overflows,
+    // to avoid flooding the log.
+    if (!_queue_overflowing)
+    {
+      TRC_WARNING("Write-behind queue to %s is full, sending writes synchronously",
+                  _server.c_str());
+      _queue_overflowing = true;
+    }
+    ++_writes_overflowed;
+
+    pthread_mutex_unlock(&_write_lock);
+
+    // Any older write to the key that is still queued would overwrite this
+    // one when it is sent, so throw it away first.
+    cancel_writes(key);
+    send_now(key, data, vbucket, expiry, flags);
+    return;
+  }
+
+  if (_queue_overflowing)
+  {
+    TRC_INFO("Write-behind queue to %s has space again (%ld writes sent synchronously in total)",
+             _server.c_str(),
+             _writes_overflowed);
+    _queue_overflowing = false;
+  }
 
-    conn->read_replicas.resize(_vbuckets);
-    conn->write_replicas.resize(_vbuckets);
+  PendingWrite write;
+  write.key = key;
+  write.data = data;
+  write.vbucket = vbucket;
+  write.expiry = expiry;
+  write.flags = flags;
+  write.queued_ms = current_time_ms();
+  _write_queue.push_back(write);
+  _write_queue_bytes += bytes;
+  pthread_cond_signal(&_write_cond);
+
+  pthread_mutex_unlock(&_write_lock);
+}
+
+
+void MemcachedBackend::ServerPool::cancel_writes(const std::string& key)
+{
+  if (!_writer_started)
+  {
+    // Writes are never queued, so there's nothing to do.
+    return;
+  }
 
-    // Now set up the read and write replica sets.
-    for (int ii = 0; ii < _vbuckets; ++ii)
+  pthread_mutex_lock(&_write_lock);
+
+  std::deque<PendingWrite>::iterator it = _write_queue.begin();
+  while (it != _write_queue.end())
+  {
+    if (it->key == key)
     {
-      conn->read_replicas[ii].resize(_read_replicas[ii].size());
-      for (size_t jj = 0; jj < _read_replicas[ii].size(); ++jj)
+      TRC_DEBUG("Discarding queued write of %s to %s", key.c_str(), _server.c_str());
+      _write_queue_bytes -= it->key.length() + it->data.length();
+      it = _write_queue.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  // The batch being sent can't be recalled, so wait until it has been sent.
+  bool in_flight = true;
+  while (in_flight)
+  {
+    in_flight = false;
+    for (size_t ii = 0; ii < _write_batch.size(); ++ii)
+    {
+      if (_write_batch[ii].key == key)
       {
-        conn->read_replicas[ii][jj] = conn->st[_read_replicas[ii][jj]];
+        in_flight = true;
+        pthread_cond_wait(&_write_done_cond, &_write_lock);
+        break;
       }
-      conn->write_replicas[ii].resize(_write_replicas[ii].size());
-      for (size_t jj = 0; jj < _write_replicas[ii].size(); ++jj)
+    }
+  }
+
+  pthread_mutex_unlock(&_write_lock);
+}
+
+
+void MemcachedBackend::ServerPool::send_now(const std::string& key,
+                                            const std::string& data,
+                                            int vbucket,
+                                            int expiry,
+                                            uint32_t flags)
+{
+  memcached_st* st = checkout();
+  memcached_behavior_set(st, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+  memcached_return_t rc = memcached_set_vb(st,
+                                           key.c_str(),
+                                           key.length(),
+                                           vbucket,
+                                           data.data(),
+                                           data.length(),
+                                           expiry,
+                                           flags);
+  memcached_behavior_set(st, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+
+  if (!memcached_success(rc))
+  {
+    // Count this as a batch (of one write) that couldn't be sent.
+    TRC_DEBUG("Failed to send write of %s to %s (%s)",
+              key.c_str(),
+              _server.c_str(),
+              memcached_strerror(st, rc));
+    pthread_mutex_lock(&_write_lock);
+    ++_batches_failed;
+    pthread_mutex_unlock(&_write_lock);
+  }
+
+  checkin(st);
+}
+
+
+void MemcachedBackend::ServerPool::write_behind_state(size_t& queued,
+                                                      unsigned long& lag_ms,
+                                                      uint64_t& overflowed,
+                                                      uint64_t& failed)
+{
+  pthread_mutex_lock(&_write_lock);
+
+  queued = _write_queue.size();
+  overflowed = _writes_overflowed;
+  failed = _batches_failed;
+
+  unsigned long oldest_ms = _write_in_flight_ms;
+  if ((oldest_ms == 0) && (!_write_queue.empty()))
+  {
+    oldest_ms = _write_queue.front().queued_ms;
+  }
+
+  lag_ms = (oldest_ms != 0) ? current_time_ms() - oldest_ms : 0;
+
+  pthread_mutex_unlock(&_write_lock);
+}
+
+
+void* MemcachedBackend::ServerPool::writer_thread_entry_point(void* pool_param)
+{
+  ((ServerPool*)pool_param)->writer_thread_fn();
+  return NULL;
+}
+
+
+void MemcachedBackend::ServerPool::writer_thread_fn()
+{
+  // The writer has a connection of its own.  It doesn't wait for responses
+  // to its writes, and buffers each batch so that it is sent in as few
+  // packets as possible.
+  memcached_st* st = create_connection();
+  memcached_behavior_set(st, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+  memcached_behavior_set(st, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+
+  pthread_mutex_lock(&_write_lock);
+
+  while (true)
+  {
+    while ((!_terminated) && (_write_queue.empty()))
+    {
+      pthread_cond_wait(&_write_cond, &_write_lock);
+    }
+
+    // When terminating, keep going until the queue has been emptied, unless
+    // the server can't be reached.
+    if ((_terminated) && ((_write_queue.empty()) || (_batches_failing)))
+    {
+      break;
+    }
+
+    while ((!_write_queue.empty()) &&
+           (_write_batch.size() < MAX_WRITE_BEHIND_BATCH))
+    {
+      PendingWrite& write = _write_queue.front();
+      _write_queue_bytes -= write.key.length() + write.data.length();
+      _write_batch.push_back(PendingWrite());
+      std::swap(_write_batch.back(), write);
+      _write_queue.pop_front();
+    }
+    _write_in_flight_ms = _write_batch.front().queued_ms;
+
+    pthread_mutex_unlock(&_write_lock);
+
+    TRC_DEBUG("Sending %d queued writes to %s", _write_batch.size(), _server.c_str());
+
+    for (size_t ii = 0; ii < _write_batch.size(); ++ii)
+    {
+      memcached_set_vb(st,
+                       _write_batch[ii].key.c_str(),
+                       _write_batch[ii].key.length(),
+                       _write_batch[ii].vbucket,
+                       _write_batch[ii].data.data(),
+                       _write_batch[ii].data.length(),
+                       _write_batch[ii].expiry,
+                       _write_batch[ii].flags);
+    }
+
+    memcached_return_t rc = memcached_flush_buffers(st);
+
+    pthread_mutex_lock(&_write_lock);
+    size_t batch_size = _write_batch.size();
+    _write_batch.clear();
+    _write_in_flight_ms = 0;
+    pthread_cond_broadcast(&_write_done_cond);
+
+    if (!memcached_success(rc))
+    {
+      // Only log the first batch that fails, to avoid flooding the log while
+      // the server is unreachable.
+      if (!_batches_failing)
       {
-        conn->write_replicas[ii][jj] = conn->st[_write_replicas[ii][jj]];
+        TRC_WARNING("Failed to send %d writes to %s (%s)",
+                    batch_size,
+                    _server.c_str(),
+                    memcached_strerror(st, rc));
+        _batches_failing = true;
       }
+      ++_batches_failed;
+    }
+    else if (_batches_failing)
+    {
+      TRC_INFO("Sending writes to %s again (%ld batches failed in total)",
+               _server.c_str(),
+               _batches_failed);
+      _batches_failing = false;
     }
+  }
+
+  if (!_write_queue.empty())
+  {
+    TRC_WARNING("Discarding %d queued writes to unreachable server %s",
+                _write_queue.size(),
+                _server.c_str());
+    _write_queue.clear();
+    _write_queue_bytes = 0;
+  }
 
-    // Flag that we are in sync with the latest view.
-    conn->view_number = _view_number;
+  pthread_mutex_unlock(&_write_lock);
 
-    pthread_rwlock_unlock(&_view_lock);
+  memcached_free(st);
+}
+
+
+memcached_st* MemcachedBackend::ServerPool::create_connection()
+{
+  // Create a new memcached_st for this server.  Do not specify the server
+  // at this point as memcached() does not support IPv6 addresses.
+  TRC_DEBUG("Setting up connection to server %s (%s)", _server.c_str(), _options.c_str());
+  memcached_st* st = memcached(_options.c_str(), _options.length());
+  TRC_DEBUG("Set up connection %p to server %s", st, _server.c_str());
+
+  // Switch to a longer connect timeout from here on.
+  memcached_behavior_set(st, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, _connect_timeout_ms);
+
+  // Disable Nagle's algorithm
+  // (https://en.wikipedia.org/wiki/Nagle%27s_algorithm). If we leave it on
+  // there can be up to 500ms delay between this code sending an
+  // asynchronous SET and it actually being sent on the wire, e.g.
+  //
+  // * Ask libmemcached to do async SET.
+  // * Async SET sent on the wire.
+  // * Ask libmemcached to do a 2nd async SET.
+  // * Up to 500ms passes.
+  // * TCP stack receives ACK to 1st SET (may be delayed because the server
+  //   does not send a protocol level response to the async SET).
+  // * 2nd async SET sent on the wire (up to 500ms late).
+  //
+  // This delay can open up window conditions in failure scenarios. In
+  // addition there is not much point in using Nagle. libmemcached's buffers
+  // are large enough that it will never send small message fragments, and
+  // this store's implementation means we very rarely pipeline requests.
+  memcached_behavior_set(st, MEMCACHED_BEHAVIOR_TCP_NODELAY, true);
+
+  std::string server;
+  int port;
+  if (Utils::split_host_port(_server, server, port))
+  {
+    TRC_DEBUG("Setting server to IP address %s port %d",
+              server.c_str(),
+              port);
+    memcached_server_add(st, server.c_str(), port);
+  }
+  else
+  {
+    TRC_ERROR("Malformed host/port %s, skipping server", _server.c_str());
   }
 
-  return (operation == Op::READ) ? conn->read_replicas[vbucket] : conn->write_replicas[vbucket];
+  return st;
 }
 
 
@@ -346,47 +960,222 @@ void MemcachedBackend::update_vbucket_comm_state(int vbucket, CommState state)
   }
 }
 
-unsigned long MemcachedBackend::current_time_ms()
+MemcachedBackend::HedgePolicy::HedgePolicy(unsigned int percentile,
+                                           unsigned int max_hedge_percent,
+                                           unsigned int max_delay_ms) :
+  _percentile(percentile),
+  _max_hedge_percent(max_hedge_percent),
+  _max_delay_ms(max_delay_ms),
+  _delay_ms(0),
+  _latencies(),
+  _hedges(0)
 {
-  struct timespec ts;
+  pthread_mutex_init(&_lock, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &_period_start);
+}
 
-  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  return ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+MemcachedBackend::HedgePolicy::~HedgePolicy()
+{
+  pthread_mutex_destroy(&_lock);
 }
 
-/// Called to clean up the thread local data for a thread using the
-/// MemcachedBackend class.
-void MemcachedBackend::cleanup_connection(void* p)
+
+unsigned int MemcachedBackend::HedgePolicy::hedge_delay_ms()
 {
-  MemcachedBackend::connection* conn = (MemcachedBackend::connection*)p;
+  unsigned int delay_ms = 0;
 
-  for (std::map<std::string, memcached_st*>::iterator it = conn->st.begin();
-       it != conn->st.end();
-       it++)
+  pthread_mutex_lock(&_lock);
+
+  // Only hedge if doing so would keep the reads hedged this period within
+  // the limit.
+  if ((_hedges + 1) * 100 <= _max_hedge_percent * (_latencies.size() + 1))
   {
-    memcached_free(it->second);
-    it->second = NULL;
+    delay_ms = _delay_ms;
   }
 
-  delete conn;
+  pthread_mutex_unlock(&_lock);
+
+  return delay_ms;
 }
 
 
+void MemcachedBackend::HedgePolicy::record_read(uint64_t latency_us, bool hedged)
+{
+  pthread_mutex_lock(&_lock);
+
+  _latencies.push_back(latency_us);
+  if (hedged)
+  {
+    ++_hedges;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t elapsed_us = (now.tv_sec - _period_start.tv_sec) * 1000000 +
+                        (now.tv_nsec - _period_start.tv_nsec) / 1000;
+
+  if (elapsed_us >= PERIOD_US)
+  {
+    // Work out the response time at the percentile over the period, rounded
+    // up to a whole number of milliseconds (the granularity of libmemcached's
+    // timeouts).  There's no point hedging if this is as long as a read would
+    // wait anyway.
+    std::vector<uint64_t>::iterator pctl =
+      _latencies.begin() + (_latencies.size() * _percentile) / 100;
+    std::nth_element(_latencies.begin(), pctl, _latencies.end());
+
+    unsigned int delay_ms = (*pctl + 999) / 1000;
+    _delay_ms = (delay_ms < _max_delay_ms) ? std::max(delay_ms, 1u) : 0;
+
+    TRC_DEBUG("%dth percentile read response time is %lluus (%llu of %llu reads hedged) - hedge delay is now %dms",
+              _percentile,
+              (unsigned long long)*pctl,
+              (unsigned long long)_hedges,
+              (unsigned long long)_latencies.size(),
+              _delay_ms);
+
+    _latencies.clear();
+    _hedges = 0;
+    _period_start = now;
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* MemcachedBackend::stats_thread_entry_point(void* backend_param)
+{
+  ((MemcachedBackend*)backend_param)->stats_thread_fn();
+  return NULL;
+}
+
+
+/// Reports the state of each server's write-behind queue, once a second,
+/// whenever it has changed.
+void MemcachedBackend::stats_thread_fn()
+{
+  pthread_mutex_lock(&_stats_lock);
+
+  while (!_stats_terminated)
+  {
+    struct timespec next_report;
+    clock_gettime(CLOCK_MONOTONIC, &next_report);
+    next_report.tv_sec += 1;
+    pthread_cond_timedwait(&_stats_cond, &_stats_lock, &next_report);
+
+    std::shared_ptr<View> view = current_view();
+    std::vector<std::string> values;
+
+    for (std::map<std::string, std::shared_ptr<ServerPool> >::const_iterator it =
+           view->pools.begin();
+         it != view->pools.end();
+         ++it)
+    {
+      size_t queued;
+      unsigned long lag_ms;
+      uint64_t overflowed;
+      uint64_t failed;
+      it->second->write_behind_state(queued, lag_ms, overflowed, failed);
+
+      std::string address;
+      int port;
+      if (!Utils::split_host_port(it->first, address, port))
+      {
+        continue;
+      }
+
+      values.push_back(address);
+      values.push_back(std::to_string(port));
+      values.push_back(std::to_string(queued));
+      values.push_back(std::to_string(lag_ms));
+      values.push_back(std::to_string(overflowed));
+      values.push_back(std::to_string(failed));
+      values.push_back(std::to_string(it->second->circuit_state()));
+    }
+
+    if (values != _replica_stats)
+    {
+      _replica_statistic->report_change(values);
+      _replica_stats.swap(values);
+    }
+  }
+
+  pthread_mutex_unlock(&_stats_lock);
+}
+
+
+void* MemcachedBackend::prober_thread_entry_point(void* backend_param)
+{
+  ((MemcachedBackend*)backend_param)->prober_thread_fn();
+  return NULL;
+}
+
+
+/// Probes each server whose circuit is open once a second, so that it is
+/// used again as soon as it recovers.
+void MemcachedBackend::prober_thread_fn()
+{
+  pthread_mutex_lock(&_prober_lock);
+
+  while (!_prober_terminated)
+  {
+    struct timespec next_probe;
+    clock_gettime(CLOCK_MONOTONIC, &next_probe);
+    next_probe.tv_sec += 1;
+    pthread_cond_timedwait(&_prober_cond, &_prober_lock, &next_probe);
+
+    if (_prober_terminated)
+    {
+      break;
+    }
+
+    // Don't hold the lock while probing, as each probe may have to wait for
+    // the connect timeout.
+    pthread_mutex_unlock(&_prober_lock);
+
+    std::shared_ptr<View> view = current_view();
+    for (std::map<std::string, std::shared_ptr<ServerPool> >::const_iterator it =
+           view->pools.begin();
+         it != view->pools.end();
+         ++it)
+    {
+      it->second->probe();
+    }
+    view.reset();
+
+    pthread_mutex_lock(&_prober_lock);
+  }
+
+  pthread_mutex_unlock(&_prober_lock);
+}
+
+
+unsigned long MemcachedBackend::current_time_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+}
+
 Memcached::ResultCode MemcachedBackend::read_data(const std::string& key,
                                                   std::string& data,
                                                   uint64_t& cas)
 {
-  Memcached::ResultCode status = Memcached::ResultCode::NO_ERROR;
-
   int vbucket = vbucket_for_key(key);
-  const std::vector<memcached_st*>& replicas = get_replicas(vbucket, Op::READ);
+  std::shared_ptr<View> view = current_view();
+  std::vector<ServerPool*> reordered;
+  const std::vector<ServerPool*>& replicas =
+    healthy_first(get_replicas(*view, vbucket, Op::READ), reordered);
 
   TRC_DEBUG("%d read replicas for key %s", replicas.size(), key.c_str());
 
   // Read from all replicas until we get a positive result.
   memcached_return_t rc = MEMCACHED_ERROR;
   bool active_not_found = false;
+  bool hedged_primary = false;
   size_t failed_replicas = 0;
   size_t ii;
 
@@ -400,7 +1189,15 @@ Memcached::ResultCode MemcachedBackend::read_data(const std::string& key,
   {
     size_t replica_idx;
 
-    if ((replicas.size() == 1) && (ii == 1))
+    if (hedged_primary)
+    {
+      // The read of the first replica was abandoned in favour of the second.
+      // If the second replica doesn't have the record that may just be
+      // because a write hasn't reached it yet, so go back to the first
+      // replica (this time with the full timeout) before the others.
+      replica_idx = (ii <= 1) ? ii : (ii == 2) ? 0 : ii - 1;
+    }
+    else if ((replicas.size() == 1) && (ii == 1))
     {
       if (rc != MEMCACHED_CONNECTION_FAILURE)
       {
@@ -416,10 +1213,83 @@ Memcached::ResultCode MemcachedBackend::read_data(const std::string& key,
       replica_idx = ii;
     }
 
-    TRC_DEBUG("Attempt to read from replica %d (connection %p)",
+    if ((active_not_found) && (!replicas[replica_idx]->healthy()))
+    {
+      // A healthy replica has already answered, so don't wait for one that
+      // is known to be failing.
+      TRC_DEBUG("Skip reading from failed replica %d (%s)",
+                replica_idx,
+                replicas[replica_idx]->server().c_str());
+      ++failed_replicas;
+      continue;
+    }
+
+    TRC_DEBUG("Attempt to read from replica %d (%s)",
               replica_idx,
-              replicas[replica_idx]);
-    rc = get_from_replica(replicas[replica_idx], key.c_str(), key.length(), data, cas);
+              replicas[replica_idx]->server().c_str());
+    memcached_st* st = replicas[replica_idx]->checkout();
+
+    // If reads are being hedged, only wait for the first replica for the
+    // hedge delay.  libmemcached can't wait for two servers at once, so if the
+    // first replica doesn't answer in time its request is abandoned and the
+    // read moves straight on to the next replica.  Only a hit from that
+    // replica is used - otherwise the first replica is read again.
+    bool hedging = ((ii == 0) && (replicas.size() > 1) && (_hedge_policy != NULL));
+    unsigned int hedge_delay_ms = hedging ? _hedge_policy->hedge_delay_ms() : 0;
+    struct timespec start;
+
+    if (hedging)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    if (hedge_delay_ms != 0)
+    {
+      memcached_behavior_set(st, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, hedge_delay_ms);
+    }
+
+    rc = get_from_replica(st, key.c_str(), key.length(), data, cas);
+
+    if (hedge_delay_ms != 0)
+    {
+      memcached_behavior_set(st, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, POLL_TIMEOUT_MS);
+    }
+
+    const char* error = memcached_strerror(st, rc);
+    bool hedged = ((hedge_delay_ms != 0) && (rc == MEMCACHED_TIMEOUT));
+
+    if (hedged)
+    {
+      // The response may still arrive, so close the connection rather than
+      // leave it for the next request to read.  It reconnects when next used.
+      memcached_quit(st);
+    }
+
+    replicas[replica_idx]->checkin(st);
+
+    if (hedging)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      uint64_t latency_us = (now.tv_sec - start.tv_sec) * 1000000 +
+                            (now.tv_nsec - start.tv_nsec) / 1000;
+      _hedge_policy->record_read(latency_us, hedged);
+
+      if (hedged)
+      {
+        TRC_DEBUG("No response for %s from replica 0 within %dms, hedging to replica 1",
+                  key.c_str(),
+                  hedge_delay_ms);
+
+        // This only shows the replica is slow, not that it has failed, so
+        // don't record a failure against it or count it as a failed replica.
+        hedged_primary = true;
+        ++attempts;
+        continue;
+      }
+    }
+
+    replicas[replica_idx]->record_result(rc);
 
     if (memcached_success(rc))
     {
@@ -435,17 +1305,212 @@ Memcached::ResultCode MemcachedBackend::read_data(const std::string& key,
       // find data on a later replica we can reset the cas value returned to
       // zero to ensure a subsequent write will succeed.
       TRC_DEBUG("Read for %s on replica %d returned NOTFOUND", key.c_str(), replica_idx);
-      active_not_found = true;
+
+      // A miss on the replica read in place of a hedged one isn't trusted, as
+      // the first replica is read again.
+      if ((!hedged_primary) || (ii != 1))
+      {
+        active_not_found = true;
+      }
     }
     else
     {
       // Error from this node, so consider it inactive.
       TRC_DEBUG("Read for %s on replica %d returned error %d (%s)",
-                key.c_str(), replica_idx, rc, memcached_strerror(replicas[replica_idx], rc));
+                key.c_str(), replica_idx, rc, error);
       ++failed_replicas;
     }
   }
 
+  return complete_read(key,
+                       vbucket,
+                       replicas.size(),
+                       rc,
+                       active_not_found,
+                       failed_replicas,
+                       data,
+                       cas);
+}
+
+
+void MemcachedBackend::read_data_multi(const std::vector<std::string>& keys,
+                                       std::vector<std::string>& data,
+                                       std::vector<uint64_t>& cas,
+                                       std::vector<Memcached::ResultCode>& status)
+{
+  size_t num_keys = keys.size();
+  data.assign(num_keys, std::string());
+  cas.assign(num_keys, 0);
+  status.assign(num_keys, Memcached::ResultCode::NO_ERROR);
+
+  // The state of the read for each key. This mirrors the state kept by
+  // read_data for a single key.
+  struct KeyState
+  {
+    int vbucket;
+    std::vector<ServerPool*> replicas;
+    size_t attempts;
+    size_t next_attempt;
+    memcached_return_t rc;
+    bool active_not_found;
+    size_t failed_replicas;
+  };
+  std::vector<KeyState> states(num_keys);
+  std::shared_ptr<View> view = current_view();
+
+  for (size_t ii = 0; ii < num_keys; ++ii)
+  {
+    KeyState& state = states[ii];
+    state.vbucket = vbucket_for_key(keys[ii]);
+    std::vector<ServerPool*> reordered;
+    state.replicas = healthy_first(get_replicas(*view, state.vbucket, Op::READ),
+                                   reordered);
+    state.attempts = (state.replicas.size() == 1) ? 2 : state.replicas.size();
+    state.next_attempt = 0;
+    state.rc = MEMCACHED_ERROR;
+    state.active_not_found = false;
+    state.failed_replicas = 0;
+  }
+
+  // Each pass sends one batched request to each replica that has keys to be
+  // read from it. Keys that aren't successfully read move on to their next
+  // replica in the following pass, exactly as they would in read_data.
+  bool keys_pending = true;
+
+  while (keys_pending)
+  {
+    std::map<ServerPool*, std::vector<size_t>> batches;
+
+    for (size_t ii = 0; ii < num_keys; ++ii)
+    {
+      KeyState& state = states[ii];
+
+      // Once a healthy replica has answered, don't wait for any that are
+      // known to be failing.
+      while ((state.active_not_found) &&
+             (state.next_attempt < state.replicas.size()) &&
+             (!state.replicas[state.next_attempt]->healthy()))
+      {
+        ++state.failed_replicas;
+        ++state.next_attempt;
+      }
+
+      if ((state.next_attempt >= state.attempts) || (memcached_success(state.rc)))
+      {
+        continue;
+      }
+
+      if ((state.replicas.size() == 1) && (state.next_attempt == 1))
+      {
+        if (state.rc != MEMCACHED_CONNECTION_FAILURE)
+        {
+          // This is a legitimate error, not a server failure, so we
+          // shouldn't retry.
+          state.next_attempt = state.attempts;
+          continue;
+        }
+        TRC_WARNING("Failed to read from sole memcached replica: retrying once");
+        batches[state.replicas[0]].push_back(ii);
+      }
+      else
+      {
+        batches[state.replicas[state.next_attempt]].push_back(ii);
+      }
+    }
+
+    keys_pending = !batches.empty();
+
+    for (std::map<ServerPool*, std::vector<size_t>>::const_iterator it = batches.begin();
+         it != batches.end();
+         ++it)
+    {
+      ServerPool* pool = it->first;
+      const std::vector<size_t>& indexes = it->second;
+
+      std::vector<const char*> key_ptrs;
+      std::vector<size_t> key_lens;
+      key_ptrs.reserve(indexes.size());
+      key_lens.reserve(indexes.size());
+
+      for (size_t jj = 0; jj < indexes.size(); ++jj)
+      {
+        key_ptrs.push_back(keys[indexes[jj]].data());
+        key_lens.push_back(keys[indexes[jj]].length());
+      }
+
+      TRC_DEBUG("Attempt to read %d keys from replica %s",
+                indexes.size(),
+                pool->server().c_str());
+
+      memcached_st* replica = pool->checkout();
+
+      std::vector<std::string> batch_data;
+      std::vector<uint64_t> batch_cas;
+      std::vector<memcached_return_t> batch_rcs;
+      memcached_return_t rc = get_multi_from_replica(replica,
+                                                     key_ptrs,
+                                                     key_lens,
+                                                     batch_data,
+                                                     batch_cas,
+                                                     batch_rcs);
+      pool->record_result(rc);
+
+      for (size_t jj = 0; jj < indexes.size(); ++jj)
+      {
+        size_t idx = indexes[jj];
+        KeyState& state = states[idx];
+        state.rc = batch_rcs[jj];
+        state.next_attempt++;
+
+        if (memcached_success(state.rc))
+        {
+          TRC_DEBUG("Read for %s returned SUCCESS", keys[idx].c_str());
+          data[idx].swap(batch_data[jj]);
+          cas[idx] = batch_cas[jj];
+        }
+        else if (state.rc == MEMCACHED_NOTFOUND)
+        {
+          TRC_DEBUG("Read for %s returned NOTFOUND", keys[idx].c_str());
+          state.active_not_found = true;
+        }
+        else
+        {
+          TRC_DEBUG("Read for %s returned error %d (%s)",
+                    keys[idx].c_str(), state.rc, memcached_strerror(replica, state.rc));
+          ++state.failed_replicas;
+        }
+      }
+
+      pool->checkin(replica);
+    }
+  }
+
+  for (size_t ii = 0; ii < num_keys; ++ii)
+  {
+    KeyState& state = states[ii];
+    status[ii] = complete_read(keys[ii],
+                               state.vbucket,
+                               state.replicas.size(),
+                               state.rc,
+                               state.active_not_found,
+                               state.failed_replicas,
+                               data[ii],
+                               cas[ii]);
+  }
+}
+
+
+Memcached::ResultCode MemcachedBackend::complete_read(const std::string& key,
+                                                      int vbucket,
+                                                      size_t num_replicas,
+                                                      memcached_return_t rc,
+                                                      bool active_not_found,
+                                                      size_t failed_replicas,
+                                                      std::string& data,
+                                                      uint64_t& cas)
+{
+  Memcached::ResultCode status;
+
   if (memcached_success(rc))
   {
     // Return the data and CAS value.  The CAS value is either set to the CAS
@@ -469,7 +1534,7 @@ Memcached::ResultCode MemcachedBackend::read_data(const std::string& key,
       _comm_monitor->inform_success();
     }
   }
-  else if (failed_replicas < replicas.size())
+  else if (failed_replicas < num_replicas)
   {
     // At least one replica returned NOT_FOUND.
     TRC_DEBUG("At least one replica returned not found, so return NOT_FOUND");
@@ -487,7 +1552,7 @@ Memcached::ResultCode MemcachedBackend::read_data(const std::string& key,
     // All replicas returned an error, so log the error and return the
     // failure.
     TRC_ERROR("Failed to read data for %s from %d replicas",
-              key.c_str(), replicas.size());
+              key.c_str(), num_replicas);
 
     status = Memcached::ResultCode::TEMPORARY_FAILURE;
 
@@ -523,7 +1588,10 @@ Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
             data.length(), key.c_str(), operation, cas, expiry);
 
   int vbucket = vbucket_for_key(key);
-  const std::vector<memcached_st*>& replicas = get_replicas(vbucket, Op::WRITE);
+  std::shared_ptr<View> view = current_view();
+  std::vector<ServerPool*> reordered;
+  const std::vector<ServerPool*>& replicas =
+    healthy_first(get_replicas(*view, vbucket, Op::WRITE), reordered);
 
   TRC_DEBUG("%d write replicas for key %s", replicas.size(), key.c_str());
 
@@ -564,16 +1632,18 @@ Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
       replica_idx = ii;
     }
 
-    TRC_DEBUG("Attempt conditional write to vbucket %d on replica %d (connection %p), CAS = %ld, expiry = %d",
+    TRC_DEBUG("Attempt conditional write to vbucket %d on replica %d (%s), CAS = %ld, expiry = %d",
               vbucket,
               replica_idx,
-              replicas[replica_idx],
+              replicas[replica_idx]->server().c_str(),
               cas,
               expiry);
 
+    memcached_st* st = replicas[replica_idx]->checkout();
+
     if (operation == Memcached::OpCode::ADD)
     {
-      rc = memcached_add_vb(replicas[replica_idx],
+      rc = memcached_add_vb(st,
                             key.c_str(),
                             key.length(),
                             vbucket,
@@ -584,7 +1654,7 @@ Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
     }
     else if (operation == Memcached::OpCode::SET)
     {
-      rc = memcached_set_vb(replicas[replica_idx],
+      rc = memcached_set_vb(st,
                             key.c_str(),
                             key.length(),
                             vbucket,
@@ -597,7 +1667,7 @@ Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
     {
       if (cas == 0)
       {
-        rc = memcached_replace_vb(replicas[replica_idx],
+        rc = memcached_replace_vb(st,
                                   key.c_str(),
                                   key.length(),
                                   vbucket,
@@ -608,7 +1678,7 @@ Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
       }
       else
       {
-        rc = memcached_cas_vb(replicas[replica_idx],
+        rc = memcached_cas_vb(st,
                               key.c_str(),
                               key.length(),
                               vbucket,
@@ -622,12 +1692,15 @@ Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
         {
           TRC_DEBUG("memcached_cas command failed, rc = %d (%s)\n%s",
                     rc,
-                    memcached_strerror(replicas[replica_idx], rc),
-                    memcached_last_error_message(replicas[replica_idx]));
+                    memcached_strerror(st, rc),
+                    memcached_last_error_message(st));
         }
       }
     }
 
+    replicas[replica_idx]->checkin(st);
+    replicas[replica_idx]->record_result(rc);
+
     if (memcached_success(rc))
     {
       TRC_DEBUG("Conditional write succeeded to replica %d", replica_idx);
@@ -649,20 +1722,14 @@ Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
   if (memcached_success(rc) && (replica_idx < replicas.size()))
   {
     // Write has succeeded, so write unconditionally (and asynchronously)
-    // to the replicas.
+    // to the replicas.  These writes are queued to each replica's writer
+    // thread, so a slow replica doesn't hold up this request.  This includes
+    // replicas whose circuit is open, as otherwise they would miss the write
+    // and serve stale data once they recover.
     for (size_t jj = replica_idx + 1; jj < replicas.size(); ++jj)
     {
-      TRC_DEBUG("Attempt unconditional write to replica %d", jj);
-      memcached_behavior_set(replicas[jj], MEMCACHED_BEHAVIOR_NOREPLY, 1);
-      memcached_set_vb(replicas[jj],
-                       key.c_str(),
-                       key.length(),
-                       vbucket,
-                       data.data(),
-                       data.length(),
-                       expiry,
-                       flags);
-      memcached_behavior_set(replicas[jj], MEMCACHED_BEHAVIOR_NOREPLY, 0);
+      TRC_DEBUG("Queue unconditional write to replica %d", jj);
+      replicas[jj]->write_behind(key, data, vbucket, expiry, flags);
     }
   }
 
@@ -704,8 +1771,13 @@ Memcached::ResultCode MemcachedBackend::delete_data(const std::string& key)
   Memcached::ResultCode best_status = Memcached::ResultCode::TEMPORARY_FAILURE;
 
   // Delete from the read replicas - read replicas are a superset of the write
-  // replicas
-  const std::vector<memcached_st*>& replicas = get_replicas(key, Op::READ);
+  // replicas.  The delete must reach every replica, even those that are
+  // failing, or the record could reappear when they recover, so failing
+  // replicas are tried last rather than skipped.
+  std::shared_ptr<View> view = current_view();
+  std::vector<ServerPool*> reordered;
+  const std::vector<ServerPool*>& replicas =
+    healthy_first(get_replicas(*view, key, Op::READ), reordered);
   TRC_DEBUG("Deleting from the %d read replicas for key %s",
             replicas.size(), key.c_str());
 
@@ -714,13 +1786,20 @@ Memcached::ResultCode MemcachedBackend::delete_data(const std::string& key)
 
   for (size_t ii = 0; ii < replicas.size(); ++ii)
   {
-    TRC_DEBUG("Attempt delete to replica %d (connection %p)",
-              ii, replicas[ii]);
+    TRC_DEBUG("Attempt delete to replica %d (%s)",
+              ii, replicas[ii]->server().c_str());
+
+    // Make sure a write to the key still queued for this replica can't
+    // recreate the record after it has been deleted.
+    replicas[ii]->cancel_writes(key);
 
-    memcached_return_t rc = memcached_delete(replicas[ii],
+    memcached_st* st = replicas[ii]->checkout();
+    memcached_return_t rc = memcached_delete(st,
                                              key_ptr,
                                              key_len,
                                              0);
+    replicas[ii]->checkin(st);
+    replicas[ii]->record_result(rc);
 
     if (!memcached_success(rc))
     {
@@ -781,6 +1860,87 @@ memcached_return_t MemcachedBackend::get_from_replica(memcached_st* replica,
   return rc;
 }
 
+memcached_return_t
+MemcachedBackend::get_multi_from_replica(memcached_st* replica,
+                                         const std::vector<const char*>& key_ptrs,
+                                         const std::vector<size_t>& key_lens,
+                                         std::vector<std::string>& data,
+                                         std::vector<uint64_t>& cas,
+                                         std::vector<memcached_return_t>& rcs)
+{
+  size_t num_keys = key_ptrs.size();
+  data.assign(num_keys, std::string());
+  cas.assign(num_keys, 0);
+  rcs.assign(num_keys, MEMCACHED_NOTFOUND);
+
+  memcached_return_t rc = memcached_mget(replica,
+                                         key_ptrs.data(),
+                                         key_lens.data(),
+                                         num_keys);
+
+  if (memcached_success(rc))
+  {
+    // The results come back in no particular order, and only for keys that
+    // were found, so match them up with the requested keys. The same key
+    // may have been requested more than once.
+    std::multimap<std::string, size_t> key_indexes;
+    for (size_t ii = 0; ii < num_keys; ++ii)
+    {
+      key_indexes.insert(std::make_pair(std::string(key_ptrs[ii], key_lens[ii]), ii));
+    }
+
+    TRC_DEBUG("Fetch results");
+    memcached_result_st result;
+    memcached_result_create(replica, &result);
+
+    while (memcached_fetch_result(replica, &result, &rc) != NULL)
+    {
+      if (!memcached_success(rc))
+      {
+        break;
+      }
+
+      std::string key(memcached_result_key_value(&result),
+                      memcached_result_key_length(&result));
+      std::pair<std::multimap<std::string, size_t>::iterator,
+                std::multimap<std::string, size_t>::iterator> range =
+        key_indexes.equal_range(key);
+
+      for (std::multimap<std::string, size_t>::iterator it = range.first;
+           it != range.second;
+           ++it)
+      {
+        data[it->second].assign(memcached_result_value(&result),
+                                memcached_result_length(&result));
+        cas[it->second] = memcached_result_cas(&result);
+        rcs[it->second] = MEMCACHED_SUCCESS;
+      }
+    }
+
+    memcached_result_free(&result);
+
+    // Running out of results is the normal way for the fetch to finish.
+    if ((rc == MEMCACHED_END) || (rc == MEMCACHED_NOTFOUND))
+    {
+      rc = MEMCACHED_SUCCESS;
+    }
+  }
+
+  if (!memcached_success(rc))
+  {
+    // The request failed, so fail any keys we didn't get a result for.
+    for (size_t ii = 0; ii < num_keys; ++ii)
+    {
+      if (rcs[ii] != MEMCACHED_SUCCESS)
+      {
+        rcs[ii] = rc;
+      }
+    }
+  }
+
+  return rc;
+}
+
 Memcached::ResultCode
 MemcachedBackend::libmemcached_result_to_memcache_status(memcached_return_t rc)
 {
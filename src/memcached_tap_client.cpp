@@ -39,8 +39,13 @@
 
 #include <cstring>
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <unistd.h>
 
@@ -49,59 +54,88 @@ void Memcached::Utils::write(const std::string& str, std::string& ss)
   ss.append(str);
 }
 
-bool Memcached::is_msg_complete(const std::string& msg,
-                                bool& request,
-                                uint16_t& body_length,
-                                uint8_t& op_code)
+// Move an array of iovecs on past data that has been sent.
+static void advance_iov(struct iovec* iov, size_t iovcnt, size_t sent)
 {
-  uint32_t raw_length = msg.length();
-  const char* raw = msg.data();
+  for (size_t ii = 0; (ii < iovcnt) && (sent > 0); ++ii)
+  {
+    size_t skip = std::min(sent, iov[ii].iov_len);
+    iov[ii].iov_base = (char*)iov[ii].iov_base + skip;
+    iov[ii].iov_len -= skip;
+    sent -= skip;
+  }
+}
 
-  if (raw_length < sizeof(MsgHdr))
+bool Memcached::is_quiet(uint8_t op_code)
+{
+  switch (op_code)
   {
-    // Too short
+  case (uint8_t)OpCode::GETQ:
+  case (uint8_t)OpCode::GETKQ:
+  case (uint8_t)OpCode::SETQ:
+  case (uint8_t)OpCode::ADDQ:
+  case (uint8_t)OpCode::REPLACEQ:
+  case (uint8_t)OpCode::DELETEQ:
+    return true;
+
+  default:
     return false;
   }
+}
 
-  if (raw[0] == (char)0x80)
+uint8_t Memcached::unquiet(uint8_t op_code)
+{
+  switch (op_code)
   {
-    request = true;
+  case (uint8_t)OpCode::GETQ:
+    return (uint8_t)OpCode::GET;
+  case (uint8_t)OpCode::GETKQ:
+    return (uint8_t)OpCode::GETK;
+  case (uint8_t)OpCode::SETQ:
+    return (uint8_t)OpCode::SET;
+  case (uint8_t)OpCode::ADDQ:
+    return (uint8_t)OpCode::ADD;
+  case (uint8_t)OpCode::REPLACEQ:
+    return (uint8_t)OpCode::REPLACE;
+  case (uint8_t)OpCode::DELETEQ:
+    return (uint8_t)OpCode::DELETE;
+  default:
+    return op_code;
   }
-  else
+}
+
+bool Memcached::is_msg_complete(const char* raw,
+                                size_t raw_length,
+                                size_t& length)
+{
+  length = 0;
+
+  if (raw_length < sizeof(MsgHdr))
   {
-    request = false;
+    // Too short
+    return false;
   }
 
   // Overlay the message data with the header structure to determine the full
   // length.
-  body_length = HDR_GET(raw, body_length);
+  uint32_t body_length = HDR_GET(raw, body_length);
+  length = sizeof(MsgHdr) + (size_t)body_length;
 
-  if (raw_length < sizeof(MsgHdr) + body_length)
+  if (raw_length < length)
   {
     // Too short after all
     return false;
   }
 
-  // This is a complete message, get the op-code out too.
-  op_code = HDR_GET(raw, op_code);
-
   return true;
 }
 
-bool Memcached::from_wire(std::string& msg,
-                          Memcached::BaseMessage*& output)
+Memcached::BaseMessage* Memcached::from_wire(const Memcached::MsgView& msg)
 {
-  bool request;
-  uint16_t body_length;
-  uint8_t op_code;
+  Memcached::BaseMessage* output;
+  uint8_t op_code = msg.op_code();
 
-  if (!is_msg_complete(msg, request, body_length, op_code))
-  {
-    // Need more data.
-    return false;
-  }
-
-  if (request)
+  if (msg.is_request())
   {
     switch (op_code)
     {
@@ -110,23 +144,32 @@ bool Memcached::from_wire(std::string& msg,
       break;
     case (uint8_t)OpCode::GET:
     case (uint8_t)OpCode::GETK:
+    case (uint8_t)OpCode::GETQ:
+    case (uint8_t)OpCode::GETKQ:
       output = from_wire_int<Memcached::GetReq>(msg);
       break;
     case (uint8_t)OpCode::SET:
+    case (uint8_t)OpCode::SETQ:
       output = from_wire_int<Memcached::SetReq>(msg);
       break;
     case (uint8_t)OpCode::ADD:
+    case (uint8_t)OpCode::ADDQ:
       output = from_wire_int<Memcached::AddReq>(msg);
       break;
     case (uint8_t)OpCode::REPLACE:
+    case (uint8_t)OpCode::REPLACEQ:
       output = from_wire_int<Memcached::ReplaceReq>(msg);
       break;
     case (uint8_t)OpCode::DELETE:
+    case (uint8_t)OpCode::DELETEQ:
       output = from_wire_int<Memcached::DeleteReq>(msg);
       break;
     case (uint8_t)OpCode::VERSION:
       output = from_wire_int<Memcached::VersionReq>(msg);
       break;
+    case (uint8_t)OpCode::NOOP:
+      output = from_wire_int<Memcached::NoopReq>(msg);
+      break;
     default:
       output = from_wire_int<Memcached::BaseReq>(msg);
       break;
@@ -137,38 +180,60 @@ bool Memcached::from_wire(std::string& msg,
     switch (op_code)
     {
     case (uint8_t)OpCode::GET:
+    case (uint8_t)OpCode::GETK:
+    case (uint8_t)OpCode::GETQ:
+    case (uint8_t)OpCode::GETKQ:
       output = Memcached::from_wire_int<Memcached::GetRsp>(msg);
       break;
+    case (uint8_t)OpCode::SET:
+    case (uint8_t)OpCode::SETQ:
+      output = Memcached::from_wire_int<Memcached::SetRsp>(msg);
+      break;
     case (uint8_t)OpCode::ADD:
+    case (uint8_t)OpCode::ADDQ:
       output = Memcached::from_wire_int<Memcached::AddRsp>(msg);
       break;
     case (uint8_t)OpCode::REPLACE:
+    case (uint8_t)OpCode::REPLACEQ:
       output = Memcached::from_wire_int<Memcached::ReplaceRsp>(msg);
       break;
+    case (uint8_t)OpCode::DELETE:
+    case (uint8_t)OpCode::DELETEQ:
+      output = Memcached::from_wire_int<Memcached::DeleteRsp>(msg);
+      break;
+    case (uint8_t)OpCode::NOOP:
+      output = Memcached::from_wire_int<Memcached::NoopRsp>(msg);
+      break;
     default:
       output = Memcached::from_wire_int<Memcached::BaseRsp>(msg);
       break;
     }
   }
 
-  // And finally trim the message from the start of the string.
-  msg = msg.substr(sizeof(MsgHdr) + body_length, std::string::npos);
-
-  return true;
+  return output;
 }
 
 std::string Memcached::BaseMessage::to_wire() const
 {
   std::string ss;
+  ss.reserve(wire_length());
+  const std::string& value = to_wire(ss);
+  ss.append(value);
+  return ss;
+}
 
-  // Build the message-specific sections.
-  std::string extra = generate_extra();
-  std::string value = generate_value();
+const std::string& Memcached::BaseMessage::to_wire(std::string& ss) const
+{
+  const std::string& value = generate_value();
+  uint8_t extra_len = extra_length();
   uint16_t vbucket_or_status = generate_vbucket_or_status();
 
   // Calculate body size, this is the sum of the sizes of Extras, Key and
   // Values sections.
-  uint32_t body_size = extra.length() + _key.length() + value.length();
+  uint32_t body_size = extra_len + _key.length() + value.length();
+
+  // Make room for everything up to the value in one go.
+  ss.reserve(ss.length() + sizeof(MsgHdr) + extra_len + _key.length());
 
   // In the memcache protocol the first byte (aka the "magic" byte) is 0x80 for
   // a request and 0x81 for a response.
@@ -176,56 +241,66 @@ std::string Memcached::BaseMessage::to_wire() const
   Utils::write(magic_byte, ss);
   Utils::write((uint8_t)_op_code, ss);
   Utils::write((uint16_t)_key.length(), ss);
-  Utils::write((uint8_t)extra.length(), ss);
+  Utils::write((uint8_t)extra_len, ss);
   Utils::write((uint8_t)0x00, ss); // Data Type (0x00 - RAW_DATA)
   Utils::write((uint16_t)vbucket_or_status, ss);
   Utils::write((uint32_t)body_size, ss);
   Utils::write((uint32_t)_opaque, ss);
   Utils::write((uint64_t)_cas, ss);
-  Utils::write(extra, ss);
+  generate_extra(ss);
   Utils::write(_key, ss);
-  Utils::write(value, ss);
 
-  return ss;
+  return value;
 }
 
-Memcached::BaseMessage::BaseMessage(const std::string& msg)
+size_t Memcached::BaseMessage::wire_length() const
 {
-  const char* raw = msg.data();
-  _op_code = HDR_GET(raw, op_code);
-  _opaque = HDR_GET(raw, opaque);
-  _cas = HDR_GET(raw, cas);
-  _key = msg.substr(sizeof(MsgHdr) + HDR_GET(raw, extra_length),
-                    HDR_GET(raw, key_length));
+  return sizeof(MsgHdr) + extra_length() + _key.length() + generate_value().length();
 }
 
-Memcached::BaseReq::BaseReq(const std::string& msg) : BaseMessage(msg)
+const std::string& Memcached::BaseMessage::generate_value() const
 {
-  _vbucket = HDR_GET(msg.data(), vbucket_or_status);
+  static const std::string EMPTY_VALUE;
+  return EMPTY_VALUE;
 }
 
-Memcached::BaseRsp::BaseRsp(const std::string& msg) : BaseMessage(msg)
+Memcached::BaseMessage::BaseMessage(const MsgView& msg) :
+  _op_code(msg.op_code()),
+  _key(msg.key(), msg.key_length()),
+  _opaque(msg.opaque()),
+  _cas(msg.cas())
 {
-  _status = HDR_GET(msg.data(), vbucket_or_status);
 }
 
-bool Memcached::GetReq::response_needs_key() const
+Memcached::BaseReq::BaseReq(const MsgView& msg) :
+  BaseMessage(msg),
+  _vbucket(msg.vbucket_or_status())
 {
-  return (_op_code == (uint8_t)OpCode::GETK);
 }
 
-Memcached::GetRsp::GetRsp(const std::string& msg) : BaseRsp(msg)
+Memcached::BaseRsp::BaseRsp(const MsgView& msg) :
+  BaseMessage(msg),
+  _status(msg.vbucket_or_status())
 {
-  const char* raw = msg.data();
-  uint16_t key_length = HDR_GET(raw, key_length);
-  uint8_t extra_length = HDR_GET(raw, extra_length);
-  uint32_t body_length = HDR_GET(raw, body_length);
-  raw = NULL; // It's now safe to call non-const functions on `msg`
+}
 
-  // The extra section just contains the flags.
-  std::string extra = msg.substr(sizeof(MsgHdr), extra_length);
-  _flags = Utils::network_to_host(((uint32_t*)extra.data())[0]);
-  _value = msg.substr(sizeof(MsgHdr) + extra_length + key_length, body_length - (extra_length + key_length));
+bool Memcached::GetReq::response_needs_key() const
+{
+  return ((_op_code == (uint8_t)OpCode::GETK) ||
+          (_op_code == (uint8_t)OpCode::GETKQ));
+}
+
+Memcached::GetRsp::GetRsp(const MsgView& msg) :
+  BaseRsp(msg),
+  _value(msg.value(), msg.value_length()),
+  _flags(0)
+{
+  // The extra section just contains the flags (and is absent if the key
+  // wasn't found).
+  if (msg.extra_length() >= sizeof(uint32_t))
+  {
+    _flags = Utils::read<uint32_t>(msg.extra());
+  }
 }
 
 Memcached::GetRsp::GetRsp(uint16_t status,
@@ -233,55 +308,49 @@ Memcached::GetRsp::GetRsp(uint16_t status,
                           uint64_t cas,
                           const std::string& value,
                           uint32_t flags,
-                          const std::string& key) :
-  BaseRsp((uint8_t)OpCode::GET, "", status, opaque, cas),
+                          const std::string& key,
+                          uint8_t op_code) :
+  BaseRsp(op_code, "", status, opaque, cas),
   _value(value),
   _flags(flags)
 {
   if (!key.empty())
   {
-    // We've been passed a key to put on the response. This means we need to
-    // send a GETK response rather than a GET.
-    _op_code = (uint8_t)OpCode::GETK;
+    // We've been passed a key to put on the response. If this is a plain GET
+    // response this means we need to send a GETK response instead.
+    if (_op_code == (uint8_t)OpCode::GET)
+    {
+      _op_code = (uint8_t)OpCode::GETK;
+    }
     _key = key;
   }
 }
 
-std::string Memcached::GetRsp::generate_extra() const
+uint8_t Memcached::GetRsp::extra_length() const
 {
-  std::string extras_string;
-
   // Only add the flags if a result has been found.
-  if (_status == (uint16_t)ResultCode::NO_ERROR)
-  {
-    Utils::write(_flags, extras_string);
-  }
-
-  return extras_string;
+  return (_status == (uint16_t)ResultCode::NO_ERROR) ? sizeof(uint32_t) : 0;
 }
 
-std::string Memcached::GetRsp::generate_value() const
+void Memcached::GetRsp::generate_extra(std::string& ss) const
 {
-  return _value;
+  if (_status == (uint16_t)ResultCode::NO_ERROR)
+  {
+    Utils::write(_flags, ss);
+  }
 }
 
-Memcached::SetAddReplaceReq::SetAddReplaceReq(const std::string& msg) :
+Memcached::SetAddReplaceReq::SetAddReplaceReq(const MsgView& msg) :
   BaseReq(msg),
-  _value(),
+  _value(msg.value(), msg.value_length()),
   _flags(0),
   _expiry(0)
 {
-  const char* raw = msg.data();
-  uint16_t key_length = HDR_GET(raw, key_length);
-  uint8_t extra_length = HDR_GET(raw, extra_length);
-  uint32_t body_length = HDR_GET(raw, body_length);
-  raw = NULL; // It's now safe to call non-const functions on `msg`
-
-  std::string extra = msg.substr(sizeof(MsgHdr), extra_length);
-  _flags = Utils::network_to_host(((uint32_t*)extra.data())[0]);
-  _expiry = Utils::network_to_host(((uint32_t*)extra.data())[1]);
-  _value = msg.substr(sizeof(MsgHdr) + (extra_length + key_length),
-                      body_length - (extra_length + key_length));
+  if (msg.extra_length() >= 2 * sizeof(uint32_t))
+  {
+    _flags = Utils::read<uint32_t>(msg.extra());
+    _expiry = Utils::read<uint32_t>(msg.extra() + sizeof(uint32_t));
+  }
 }
 
 Memcached::SetAddReplaceReq::SetAddReplaceReq(uint8_t command,
@@ -290,11 +359,12 @@ Memcached::SetAddReplaceReq::SetAddReplaceReq(uint8_t command,
                                               std::string value,
                                               uint64_t cas,
                                               uint32_t flags,
-                                              uint32_t expiry) :
+                                              uint32_t expiry,
+                                              uint32_t opaque) :
   BaseReq(command,
           key,
           vbucket,
-          0,
+          opaque,
           cas
          ),
   _value(value),
@@ -303,17 +373,10 @@ Memcached::SetAddReplaceReq::SetAddReplaceReq(uint8_t command,
 {
 }
 
-std::string Memcached::SetAddReplaceReq::generate_extra() const
+void Memcached::SetAddReplaceReq::generate_extra(std::string& ss) const
 {
-  std::string ss;
   Utils::write(_flags, ss); // Flags
   Utils::write(_expiry, ss); // Expiry
-  return ss;
-}
-
-std::string Memcached::SetAddReplaceReq::generate_value() const
-{
-  return _value;
 }
 
 Memcached::VersionRsp::VersionRsp(uint16_t status,
@@ -324,11 +387,6 @@ Memcached::VersionRsp::VersionRsp(uint16_t status,
 {
 }
 
-std::string Memcached::VersionRsp::generate_value() const
-{
-  return _version;
-}
-
 Memcached::TapConnectReq::TapConnectReq(const VBucketList& buckets) :
   BaseReq((uint8_t)OpCode::TAP_CONNECT,
           "",
@@ -336,48 +394,38 @@ Memcached::TapConnectReq::TapConnectReq(const VBucketList& buckets) :
           0,
           0
          ),
-  _buckets(buckets)
-{
-}
-
-std::string Memcached::TapConnectReq::generate_extra() const
-{
-  std::string ss;
-  uint32_t extra = 0x00000002; // DUMP
-  if (!_buckets.empty())
-  {
-    extra |= 0x00000004; // LIST_BUCKETS
-  }
-  Utils::write((uint32_t)extra, ss);
-  return ss;
-}
-
-std::string Memcached::TapConnectReq::generate_value() const
+  _buckets(buckets),
+  _value()
 {
-  std::string ss;
-
   if (!_buckets.empty())
   {
-    Utils::write((uint16_t)_buckets.size(), ss);
+    _value.reserve(sizeof(uint16_t) * (_buckets.size() + 1));
+    Utils::write((uint16_t)_buckets.size(), _value);
     for (VBucketIter it = _buckets.begin();
          it != _buckets.end();
          ++it)
     {
-      Utils::write((uint16_t)*it, ss); // VBucket ID
+      Utils::write((uint16_t)*it, _value); // VBucket ID
     }
   }
-
-  return ss;
 }
 
-Memcached::TapMutateReq::TapMutateReq(const std::string& msg) : BaseReq(msg)
+void Memcached::TapConnectReq::generate_extra(std::string& ss) const
 {
-  const char* raw = msg.data();
-  uint16_t key_length = HDR_GET(raw, key_length);
-  uint8_t extra_length = HDR_GET(raw, extra_length);
-  uint32_t body_length = HDR_GET(raw, body_length);
-  raw = NULL; // It's now safe to call non-const functions on `msg`
+  uint32_t extra = 0x00000002; // DUMP
+  if (!_buckets.empty())
+  {
+    extra |= 0x00000004; // LIST_BUCKETS
+  }
+  Utils::write((uint32_t)extra, ss);
+}
 
+Memcached::TapMutateReq::TapMutateReq(const MsgView& msg) :
+  BaseReq(msg),
+  _value(msg.value(), msg.value_length()),
+  _flags(0),
+  _expiry(0)
+{
   // Byte/     0       |       1       |       2       |       3       |
   //    /              |               |               |               |
   //   |0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|
@@ -391,21 +439,22 @@ Memcached::TapMutateReq::TapMutateReq(const std::string& msg) : BaseReq(msg)
   // 12| Expiration                                                    |
   //   +---------------+---------------+---------------+---------------+
   //   Total 8 bytes
-  std::string extra = msg.substr(sizeof(MsgHdr), extra_length);
-  _flags = Utils::network_to_host(((uint32_t*)extra.data())[2]);
-  _expiry = Utils::network_to_host(((uint32_t*)extra.data())[3]);
-  _value = msg.substr(sizeof(MsgHdr) + extra_length + key_length, body_length - (extra_length + key_length));
+  if (msg.extra_length() >= 4 * sizeof(uint32_t))
+  {
+    _flags = Utils::read<uint32_t>(msg.extra() + 2 * sizeof(uint32_t));
+    _expiry = Utils::read<uint32_t>(msg.extra() + 3 * sizeof(uint32_t));
+  }
 }
 
-std::string Memcached::SetVBucketReq::generate_extra() const
+void Memcached::SetVBucketReq::generate_extra(std::string& ss) const
 {
-  std::string ss;
   Utils::write((uint32_t)_status, ss);
-  return ss;
 }
 
 Memcached::Connection::Connection() :
-  _sock(-1)
+  _sock(-1),
+  _buffer(),
+  _buffer_offset(0)
 {
 }
 
@@ -429,39 +478,124 @@ bool Memcached::Connection::send(const Memcached::BaseMessage& req)
     return false;
   }
 
-  std::string bin = req.to_wire();
+  _header_buffer.clear();
+  const std::string& value = req.to_wire(_header_buffer);
+
+  // Send the header and the value together, without copying the value.
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)_header_buffer.data();
+  iov[0].iov_len = _header_buffer.length();
+  iov[1].iov_base = (void*)value.data();
+  iov[1].iov_len = value.length();
 
-  // Send the command
-  if (::send(_sock, bin.data(), bin.length(), 0) < 0)
+  return send_iov(iov, 2);
+}
+
+bool Memcached::Connection::send(const std::vector<const Memcached::BaseMessage*>& reqs)
+{
+  if (_sock < 0)
   {
-    int err = errno;
-    TRC_ERROR("Error during send() on socket (%d)", err);
-    ::close(_sock); _sock = -1;
     return false;
   }
+
+  // Serialize all the headers into the header buffer first, as it may be
+  // reallocated as it grows.
+  std::vector<size_t> header_ends;
+  std::vector<const std::string*> values;
+  header_ends.reserve(reqs.size());
+  values.reserve(reqs.size());
+  _header_buffer.clear();
+
+  for (size_t ii = 0; ii < reqs.size(); ++ii)
+  {
+    values.push_back(&reqs[ii]->to_wire(_header_buffer));
+    header_ends.push_back(_header_buffer.length());
+  }
+
+  // Now send each header followed by its value.
+  std::vector<struct iovec> iov(2 * reqs.size());
+  size_t header_start = 0;
+
+  for (size_t ii = 0; ii < reqs.size(); ++ii)
+  {
+    iov[2 * ii].iov_base = (void*)(_header_buffer.data() + header_start);
+    iov[2 * ii].iov_len = header_ends[ii] - header_start;
+    iov[2 * ii + 1].iov_base = (void*)values[ii]->data();
+    iov[2 * ii + 1].iov_len = values[ii]->length();
+    header_start = header_ends[ii];
+  }
+
+  return send_iov(iov.data(), iov.size());
+}
+
+bool Memcached::Connection::send_iov(struct iovec* iov, size_t iovcnt)
+{
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+
+  while (iovcnt > 0)
+  {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = std::min(iovcnt, (size_t)IOV_MAX);
+    ssize_t send_size = ::sendmsg(_sock, &msg, MSG_NOSIGNAL);
+
+    if (send_size < 0)
+    {
+      int err = errno;
+
+      if (err == EINTR)
+      {
+        continue;
+      }
+
+      TRC_ERROR("Error during send() on socket (%d)", err);
+      ::close(_sock); _sock = -1;
+      return false;
+    }
+
+    // Skip over whatever was sent, in case the socket didn't take all of it.
+    advance_iov(iov, iovcnt, send_size);
+
+    while ((iovcnt > 0) && (iov->iov_len == 0))
+    {
+      ++iov;
+      --iovcnt;
+    }
+  }
+
   return true;
 }
 
 Memcached::Status Memcached::Connection::recv(Memcached::BaseMessage** msg)
+{
+  MsgView view;
+  Memcached::Status status = recv(view);
+
+  if (status == Memcached::Status::OK)
+  {
+    *msg = Memcached::from_wire(view);
+  }
+
+  return status;
+}
+
+Memcached::Status Memcached::Connection::recv(Memcached::MsgView& view)
 {
   if (_sock == -1)
   {
     return Memcached::Status::DISCONNECTED;
   }
 
-  static const int BUFLEN = 16 * 1024;
-  char buf[BUFLEN];
   ssize_t recv_size = 0;
 
-  bool finished = Memcached::from_wire(_buffer, *msg);
-  while (!finished)
+  Memcached::Status status = next_view(view);
+  while ((status == Memcached::Status::OK) && (view.empty()))
   {
-    recv_size = ::recv(_sock, buf, BUFLEN, 0);
+    recv_size = recv_into_buffer();
 
     if (recv_size > 0)
     {
-      _buffer.append(buf, recv_size);
-      finished = Memcached::from_wire(_buffer, *msg);
+      status = next_view(view);
     }
     else if (recv_size == 0)
     {
@@ -478,9 +612,164 @@ Memcached::Status Memcached::Connection::recv(Memcached::BaseMessage** msg)
     }
   }
 
+  if (status != Memcached::Status::OK)
+  {
+    ::close(_sock); _sock = -1;
+  }
+
+  return status;
+}
+
+Memcached::Status Memcached::Connection::recv_buffered(Memcached::MsgView& view)
+{
+  if (_sock == -1)
+  {
+    return Memcached::Status::DISCONNECTED;
+  }
+
+  Memcached::Status status = next_view(view);
+
+  if (status != Memcached::Status::OK)
+  {
+    ::close(_sock); _sock = -1;
+  }
+
+  return status;
+}
+
+uint32_t Memcached::Connection::_max_item_size =
+  Memcached::Connection::DEFAULT_MAX_ITEM_SIZE;
+
+void Memcached::Connection::set_max_item_size(uint32_t max_item_size)
+{
+  _max_item_size = max_item_size;
+}
+
+Memcached::Status Memcached::Connection::next_view(Memcached::MsgView& view)
+{
+  const char* raw = _buffer.data() + _buffer_offset;
+  size_t raw_length = _buffer.length() - _buffer_offset;
+  size_t length;
+  bool complete = Memcached::is_msg_complete(raw, raw_length, length);
+
+  view = MsgView();
+
+  if ((length > 0) && (!header_acceptable(raw)))
+  {
+    // We have the header, and the message isn't one we're prepared to
+    // accept, so don't wait for the rest of it.
+    return Memcached::Status::ERROR;
+  }
+
+  if (complete)
+  {
+    view = MsgView(raw, length);
+    _buffer_offset += length;
+  }
+
   return Memcached::Status::OK;
 }
 
+bool Memcached::Connection::header_acceptable(const char* raw)
+{
+  uint32_t body_length = HDR_GET(raw, body_length);
+  uint32_t extra_and_key_length = (uint32_t)HDR_GET(raw, extra_length) +
+                                  (uint32_t)HDR_GET(raw, key_length);
+
+  if (body_length < extra_and_key_length)
+  {
+    TRC_ERROR("Received malformed message on %s (body length %u)",
+              _address.c_str(), body_length);
+    return false;
+  }
+  else if (body_length - extra_and_key_length > _max_item_size)
+  {
+    TRC_ERROR("Received message on %s with value of %u bytes, larger than the maximum of %u",
+              _address.c_str(), body_length - extra_and_key_length, _max_item_size);
+    return false;
+  }
+
+  return true;
+}
+
+ssize_t Memcached::Connection::recv_into_buffer()
+{
+  static const size_t BUFLEN = 16 * 1024;
+  static const size_t LARGE_BUFLEN = 64 * 1024;
+
+  // Drop the messages that have already been parsed, but only once they
+  // make up at least half the buffer, so that the cost of shuffling the
+  // unparsed data down is amortized over the data that has been parsed.
+  // Usually everything has been parsed, and this is trivial.
+  size_t unparsed = _buffer.length() - _buffer_offset;
+
+  if ((_buffer_offset > 0) && (_buffer_offset >= unparsed))
+  {
+    _buffer.erase(0, _buffer_offset);
+    _buffer_offset = 0;
+  }
+
+  // Work out how much more of the current message we're waiting for.
+  size_t length;
+  size_t outstanding = 0;
+  if ((!Memcached::is_msg_complete(_buffer.data() + _buffer_offset,
+                                   unparsed,
+                                   length)) &&
+      (length > 0))
+  {
+    // Check the header before trusting its length, so that a bad message
+    // can't make us allocate a huge buffer.
+    if (!header_acceptable(_buffer.data() + _buffer_offset))
+    {
+      errno = EPROTO;
+      return -1;
+    }
+
+    outstanding = length - unparsed;
+  }
+
+  ssize_t recv_size;
+  int err;
+
+  if (outstanding > BUFLEN)
+  {
+    // We're part way through a large message.  Make room for the rest of it
+    // up front, so that the buffer isn't reallocated as it arrives, and
+    // receive it in larger chunks than usual.
+    _buffer.reserve(_buffer.length() + outstanding);
+
+    if (_large_recv_buffer.empty())
+    {
+      _large_recv_buffer.resize(LARGE_BUFLEN);
+    }
+
+    recv_size = ::recv(_sock,
+                       _large_recv_buffer.data(),
+                       std::min(outstanding, LARGE_BUFLEN),
+                       0);
+    err = errno;
+
+    if (recv_size > 0)
+    {
+      _buffer.append(_large_recv_buffer.data(), recv_size);
+    }
+  }
+  else
+  {
+    char buf[BUFLEN];
+    recv_size = ::recv(_sock, buf, BUFLEN, 0);
+    err = errno;
+
+    if (recv_size > 0)
+    {
+      _buffer.append(buf, recv_size);
+    }
+  }
+
+  errno = err;
+  return recv_size;
+}
+
 Memcached::ClientConnection::ClientConnection(const std::string& address) :
   Connection()
 {
@@ -489,6 +778,47 @@ Memcached::ClientConnection::ClientConnection(const std::string& address) :
 
 int Memcached::ClientConnection::connect()
 {
+  // Drop any existing socket. Anything left in the receive buffer belongs
+  // to it.
+  disconnect();
+  _buffer.clear();
+  _buffer_offset = 0;
+
+  if ((!_address.empty()) && (_address[0] == '/'))
+  {
+    // This is the path of a Unix domain socket.
+    struct sockaddr_un addr;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (_address.length() >= sizeof(addr.sun_path))
+    {
+      TRC_ERROR("Socket path %s is too long", _address.c_str());
+      return -1;
+    }
+    memcpy(addr.sun_path, _address.data(), _address.length());
+
+    _sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_sock < 0)
+    {
+      int err = errno;
+      TRC_ERROR("Failed to create socket (%d)", err);
+      return err;
+    }
+
+    if (::connect(_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+      int err = errno;
+      TRC_ERROR("Failed to connect to %s (%d)",
+                _address.c_str(),
+                err);
+      ::close(_sock); _sock = -1;
+      return err;
+    }
+
+    return 0;
+  }
+
   struct addrinfo ai_hint;
   memset(&ai_hint, 0x00, sizeof(ai_hint));
   ai_hint.ai_family = AF_UNSPEC;
@@ -516,6 +846,7 @@ int Memcached::ClientConnection::connect()
   {
     int err = errno;
     TRC_ERROR("Failed to create socket (%d)", err);
+    ::freeaddrinfo(ai); ai = NULL;
     return err;
   }
 
@@ -526,6 +857,7 @@ int Memcached::ClientConnection::connect()
               _address.c_str(),
               err);
     ::close(_sock); _sock = -1;
+    ::freeaddrinfo(ai); ai = NULL;
     return err;
   }
 
@@ -541,3 +873,142 @@ Memcached::ServerConnection::ServerConnection(int sock, const std::string& addre
   _address = address;
 }
 
+Memcached::Status Memcached::ServerConnection::recv_available()
+{
+  if (_sock == -1)
+  {
+    return Memcached::Status::DISCONNECTED;
+  }
+
+  while (true)
+  {
+    ssize_t recv_size = recv_into_buffer();
+
+    if (recv_size == 0)
+    {
+      TRC_DEBUG("Socket closed by peer");
+      return Memcached::Status::DISCONNECTED;
+    }
+    else if (recv_size > 0)
+    {
+      // Keep reading until the socket is drained.
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      // We've drained the socket.
+      return Memcached::Status::OK;
+    }
+    else if (errno != EINTR)
+    {
+      int err = errno;
+      TRC_ERROR("Error during recv() on socket (%d)", err);
+      return Memcached::Status::ERROR;
+    }
+  }
+}
+
+Memcached::Status Memcached::ServerConnection::next_msg(Memcached::BaseMessage** msg)
+{
+  MsgView view;
+  Memcached::Status status = next_view(view);
+
+  *msg = ((status == Memcached::Status::OK) && (!view.empty())) ?
+           Memcached::from_wire(view) : NULL;
+
+  return status;
+}
+
+Memcached::Status Memcached::ServerConnection::write(const Memcached::BaseMessage& msg)
+{
+  if (_sock == -1)
+  {
+    return Memcached::Status::DISCONNECTED;
+  }
+
+  if (!_send_buffer.empty())
+  {
+    // The socket is already backed up, so this message has to wait its turn.
+    const std::string& value = msg.to_wire(_send_buffer);
+    _send_buffer.append(value);
+    return Memcached::Status::OK;
+  }
+
+  _header_buffer.clear();
+  const std::string& value = msg.to_wire(_header_buffer);
+
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)_header_buffer.data();
+  iov[0].iov_len = _header_buffer.length();
+  iov[1].iov_base = (void*)value.data();
+  iov[1].iov_len = value.length();
+
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = iov;
+  hdr.msg_iovlen = 2;
+
+  while ((iov[0].iov_len > 0) || (iov[1].iov_len > 0))
+  {
+    ssize_t send_size = ::sendmsg(_sock, &hdr, MSG_NOSIGNAL);
+
+    if (send_size >= 0)
+    {
+      advance_iov(iov, 2, send_size);
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      // The socket is full. Queue whatever is left until the socket becomes
+      // writable again.
+      _send_buffer.append((const char*)iov[0].iov_base, iov[0].iov_len);
+      _send_buffer.append((const char*)iov[1].iov_base, iov[1].iov_len);
+      break;
+    }
+    else if (errno != EINTR)
+    {
+      int err = errno;
+      TRC_ERROR("Error during send() on socket (%d)", err);
+      return Memcached::Status::ERROR;
+    }
+  }
+
+  return Memcached::Status::OK;
+}
+
+Memcached::Status Memcached::ServerConnection::flush()
+{
+  if (_sock == -1)
+  {
+    return Memcached::Status::DISCONNECTED;
+  }
+
+  size_t sent = 0;
+
+  while (sent < _send_buffer.length())
+  {
+    ssize_t send_size = ::send(_sock,
+                               _send_buffer.data() + sent,
+                               _send_buffer.length() - sent,
+                               MSG_NOSIGNAL);
+
+    if (send_size >= 0)
+    {
+      sent += send_size;
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      // The socket is full. The rest of the data stays queued until the
+      // socket becomes writable again.
+      break;
+    }
+    else if (errno != EINTR)
+    {
+      int err = errno;
+      TRC_ERROR("Error during send() on socket (%d)", err);
+      return Memcached::Status::ERROR;
+    }
+  }
+
+  _send_buffer.erase(0, sent);
+  return Memcached::Status::OK;
+}
+
@@ -35,8 +35,10 @@
  */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/ip.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -44,10 +46,39 @@
 #include "memcached_tap_client.hpp"
 #include "proxy_server.hpp"
 
-ProxyServer::ProxyServer(MemcachedBackend* backend) :
+// The maximum number of events to process per call to epoll_wait.
+static const int MAX_EPOLL_EVENTS = 64;
+
+// The maximum number of requests a single client connection may have
+// outstanding to the workers.  Once this is reached we stop parsing requests
+// off the connection until some have completed, so a single client can't
+// monopolize the workers or make us buffer unbounded amounts of data.
+static const int MAX_OUTSTANDING_REQUESTS = 256;
+
+// The maximum number of GETs to pass to the workers as a single batch.
+static const size_t MAX_GET_BATCH = 64;
+
+ProxyServer::ProxyServer(MemcachedBackend* backend,
+                         int num_io_threads,
+                         int num_worker_threads) :
   _listen_sock(0),
+  _num_io_threads(num_io_threads),
+  _io_threads(),
+  _next_io_thread(0),
+  _num_worker_threads(num_worker_threads),
+  _worker_threads(),
+  _request_queue(),
   _backend(backend)
 {
+  if (_num_io_threads <= 0)
+  {
+    // Default to one I/O thread per core.
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    _num_io_threads = (num_cpus > 0) ? (int)num_cpus : 1;
+  }
+
+  pthread_mutex_init(&_request_queue_lock, NULL);
+  pthread_cond_init(&_request_queue_cond, NULL);
 }
 
 ProxyServer::~ProxyServer()
@@ -128,6 +159,50 @@ bool ProxyServer::start(const char* bind_addr)
     return false;
   }
 
+  // Start the I/O threads, each with its own epoll instance.
+  for (int ii = 0; ii < _num_io_threads; ++ii)
+  {
+    IOThread* io_thread = new IOThread;
+    io_thread->server = this;
+    io_thread->epoll_fd = epoll_create1(0);
+
+    if (io_thread->epoll_fd < 0)
+    {
+      TRC_ERROR("Could not create epoll instance: %s", strerror(errno));
+      delete io_thread; io_thread = NULL;
+      return false;
+    }
+
+    rc = pthread_create(&io_thread->thread, NULL, io_thread_entry_point, io_thread);
+    if (rc != 0)
+    {
+      TRC_ERROR("Could not start I/O thread: %d", rc);
+      close(io_thread->epoll_fd);
+      delete io_thread; io_thread = NULL;
+      return false;
+    }
+
+    _io_threads.push_back(io_thread);
+  }
+
+  TRC_STATUS("Started %d I/O threads", _num_io_threads);
+
+  // Start the worker threads.
+  for (int ii = 0; ii < _num_worker_threads; ++ii)
+  {
+    pthread_t worker_thread;
+    rc = pthread_create(&worker_thread, NULL, worker_thread_entry_point, this);
+    if (rc != 0)
+    {
+      TRC_ERROR("Could not start worker thread: %d", rc);
+      return false;
+    }
+
+    _worker_threads.push_back(worker_thread);
+  }
+
+  TRC_STATUS("Started %d worker threads", _num_worker_threads);
+
   // Start the listening thread.
   rc = pthread_create(&_listen_thread, NULL, listen_thread_entry_point, this);
   if (rc < 0)
@@ -195,132 +270,545 @@ void ProxyServer::listen_thread_fn()
 
       TRC_STATUS("Accepted socket from %s", addr_string.c_str());
 
-      // Create a new connection, and a new thread to service it.
-      Memcached::ServerConnection* connection =
-        new Memcached::ServerConnection(sock, addr_string);
+      // The I/O threads never block on client sockets.
+      int flags = fcntl(sock, F_GETFL, 0);
+      if ((flags < 0) || (fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0))
+      {
+        TRC_WARNING("Could not make socket non-blocking: %s", strerror(errno));
+        close(sock);
+        continue;
+      }
 
-      ConnectionThreadParams* params = new ConnectionThreadParams;
-      params->server = this;
-      params->connection = connection;
+      // Create a new connection and hand it to the next I/O thread.
+      IOThread* io_thread = _io_threads[_next_io_thread];
+      _next_io_thread = (_next_io_thread + 1) % _io_threads.size();
 
-      pthread_t tid;
-      int rc = pthread_create(&tid,
-                              NULL,
-                              connection_thread_entry_point,
-                              params);
-      if (rc < 0)
+      Client* client =
+        new Client(new Memcached::ServerConnection(sock, addr_string), io_thread);
+
+      struct epoll_event event;
+      event.events = client->registered_events;
+      event.data.ptr = client;
+
+      if (epoll_ctl(io_thread->epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0)
       {
-        // Couldn't create a thread to handle this connection. Just close it.
-        TRC_WARNING("Could not create per-connection thread: %d", rc);
-        delete connection; connection = NULL;
+        // Couldn't hand this connection to an I/O thread. Just close it.
+        TRC_WARNING("Could not add connection to epoll: %s", strerror(errno));
+        release_client(client); client = NULL;
       }
     }
   }
 }
 
-void* ProxyServer::connection_thread_entry_point(void* params_arg)
+void* ProxyServer::io_thread_entry_point(void* params)
 {
-  ConnectionThreadParams* params = (ConnectionThreadParams*)params_arg;
-  params->server->connection_thread_fn(params->connection);
-  delete params; params = NULL;
+  IOThread* io_thread = (IOThread*)params;
+  io_thread->server->io_thread_fn(io_thread);
   return NULL;
 }
 
-void ProxyServer::connection_thread_fn(Memcached::ServerConnection* connection)
+void ProxyServer::io_thread_fn(IOThread* io_thread)
 {
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+
+  while (true)
+  {
+    int num_events = epoll_wait(io_thread->epoll_fd,
+                                events,
+                                MAX_EPOLL_EVENTS,
+                                -1);
+    if (num_events < 0)
+    {
+      if (errno != EINTR)
+      {
+        // As with accept, there is no way to recover from this.
+        TRC_ERROR("Error waiting for epoll events: %s", strerror(errno));
+        exit(1);
+      }
+      continue;
+    }
+
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      Client* client = (Client*)events[ii].data.ptr;
+
+      if (!handle_client_event(client, events[ii].events))
+      {
+        close_client(client);
+      }
+    }
+  }
+}
+
+ProxyServer::Client::Client(Memcached::ServerConnection* connection,
+                            IOThread* io_thread) :
+  connection(connection),
+  io_thread(io_thread),
+  refs(1),
+  next_seq(0),
+  outstanding(),
+  pending_noops(),
+  read_paused(false),
+  closed(false),
+  registered_events(EPOLLIN | EPOLLRDHUP)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+ProxyServer::Client::~Client()
+{
+  delete connection; connection = NULL;
+  pthread_mutex_destroy(&lock);
+}
+
+bool ProxyServer::handle_client_event(Client* client, uint32_t events)
+{
+  Memcached::ServerConnection* connection = client->connection;
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+  {
+    // Read everything that's available.
+    Memcached::Status status = connection->recv_available();
+
+    if (status == Memcached::Status::DISCONNECTED)
+    {
+      // Any requests still outstanding can't be responded to, so there's no
+      // point processing anything else.
+      TRC_STATUS("Client %s has disconnected", connection->address().c_str());
+      return false;
+    }
+    else if (status != Memcached::Status::OK)
+    {
+      TRC_STATUS("Connection %s encountered an error", connection->address().c_str());
+      return false;
+    }
+  }
+
+  // Dispatch every complete request in the receive buffer, up to the limit
+  // on outstanding requests. We do this on every event, not just when there
+  // is new data, as we may previously have stopped part way through the
+  // buffer.
+  bool paused = false;
   bool keep_going = true;
+  Memcached::BaseMessage* msg = NULL;
+  Request get_batch;
+  get_batch.client = client;
+
+  while (true)
+  {
+    pthread_mutex_lock(&client->lock);
+    paused = (client->outstanding.size() >= MAX_OUTSTANDING_REQUESTS);
+    pthread_mutex_unlock(&client->lock);
+
+    if (paused)
+    {
+      break;
+    }
+
+    if (connection->next_msg(&msg) != Memcached::Status::OK)
+    {
+      TRC_STATUS("Connection %s sent an invalid request",
+                 connection->address().c_str());
+      keep_going = false;
+      break;
+    }
+
+    if (msg == NULL)
+    {
+      // Need more data.
+      break;
+    }
+
+    if (!dispatch_request(client, msg, get_batch))
+    {
+      keep_going = false;
+      break;
+    }
+  }
+
+  // Pass on any GETs that haven't been yet. We do this even if we're about
+  // to close the connection, as they are already counted as outstanding.
+  queue_request(client, get_batch);
+
+  if (!keep_going)
+  {
+    return false;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  client->read_paused = paused;
+
+  // Write out as many responses as the socket will take.
+  bool ok = (connection->flush() == Memcached::Status::OK);
+
+  if (!ok)
+  {
+    TRC_STATUS("Connection %s encountered an error", connection->address().c_str());
+  }
+  else
+  {
+    ok = update_epoll_events(client);
+  }
+
+  pthread_mutex_unlock(&client->lock);
+
+  return ok;
+}
+
+void ProxyServer::close_client(Client* client)
+{
+  // Deregister the socket, and mark the client as closed so the workers
+  // don't try to respond on it. The socket itself is closed when the last
+  // reference to the client is released.
+  pthread_mutex_lock(&client->lock);
+  client->closed = true;
+  epoll_ctl(client->io_thread->epoll_fd,
+            EPOLL_CTL_DEL,
+            client->connection->sock(),
+            NULL);
+  pthread_mutex_unlock(&client->lock);
+
+  release_client(client);
+}
+
+void ProxyServer::release_client(Client* client)
+{
+  if (--client->refs == 0)
+  {
+    delete client;
+  }
+}
+
+bool ProxyServer::update_epoll_events(Client* client)
+{
+  if (client->closed)
+  {
+    return true;
+  }
+
+  uint32_t events = EPOLLRDHUP;
+
+  if (!client->read_paused)
+  {
+    events |= EPOLLIN;
+  }
+
+  // Ask to be told about writability while there is output waiting (only
+  // then, as otherwise a level-triggered epoll would wake us constantly).
+  //
+  // We also use this to wake the I/O thread when a paused connection can
+  // accept more requests - there may be complete requests in its buffer but
+  // no more data to come, in which case EPOLLIN would never fire. The socket
+  // is almost always writable, so this fires promptly.
+  if ((client->connection->send_pending()) ||
+      ((client->read_paused) &&
+       (client->outstanding.size() < MAX_OUTSTANDING_REQUESTS)))
+  {
+    events |= EPOLLOUT;
+  }
+
+  if (events != client->registered_events)
+  {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = client;
+
+    if (epoll_ctl(client->io_thread->epoll_fd,
+                  EPOLL_CTL_MOD,
+                  client->connection->sock(),
+                  &event) < 0)
+    {
+      TRC_WARNING("Could not update epoll registration for %s: %s",
+                  client->connection->address().c_str(),
+                  strerror(errno));
+      return false;
+    }
 
-  TRC_STATUS("Starting connection thread for %s", connection->address().c_str());
+    client->registered_events = events;
+  }
 
-  while (keep_going)
+  return true;
+}
+
+bool ProxyServer::dispatch_request(Client* client,
+                                   Memcached::BaseMessage* msg,
+                                   Request& get_batch)
+{
+  bool keep_going = true;
+
+  if (msg->is_request())
   {
-    Memcached::BaseMessage* msg = NULL;
-    Memcached::Status status = connection->recv(&msg);
+    Memcached::BaseReq* req = dynamic_cast<Memcached::BaseReq*>(msg);
+    TRC_DEBUG("Received request with type: 0x%x", req->op_code());
 
-    if (status == Memcached::Status::OK)
+    uint64_t seq = client->next_seq++;
+
+    switch (req->op_code())
     {
-      if (msg->is_request())
+    case (uint8_t)Memcached::OpCode::GET:
+    case (uint8_t)Memcached::OpCode::GETK:
+    case (uint8_t)Memcached::OpCode::GETQ:
+    case (uint8_t)Memcached::OpCode::GETKQ:
       {
-        Memcached::BaseReq* req = dynamic_cast<Memcached::BaseReq*>(msg);
-        TRC_DEBUG("Received request with type: 0x%x", req->op_code());
+        // Add this to the batch of GETs, and pass the batch to the workers
+        // if it's full.
+        pthread_mutex_lock(&client->lock);
+        client->outstanding.insert(seq);
+        pthread_mutex_unlock(&client->lock);
+
+        get_batch.seqs.push_back(seq);
+        get_batch.msgs.push_back(req);
+        msg = NULL;
 
-        switch (req->op_code())
+        if (get_batch.msgs.size() >= MAX_GET_BATCH)
         {
-        case (uint8_t)Memcached::OpCode::GET:
-        case (uint8_t)Memcached::OpCode::GETK:
-          {
-            Memcached::GetReq* get_req = dynamic_cast<Memcached::GetReq*>(msg);
-            handle_get(get_req, connection);
-          }
-          break;
-
-        case (uint8_t)Memcached::OpCode::ADD:
-        case (uint8_t)Memcached::OpCode::SET:
-        case (uint8_t)Memcached::OpCode::REPLACE:
-          {
-            Memcached::SetAddReplaceReq* sar_req =
-              dynamic_cast<Memcached::SetAddReplaceReq*>(msg);
-            handle_set_add_replace(sar_req, connection);
-          }
-          break;
-
-        case (uint8_t)Memcached::OpCode::DELETE:
-          {
-            Memcached::DeleteReq* delete_req =
-              dynamic_cast<Memcached::DeleteReq*>(msg);
-            handle_delete(delete_req, connection);
-          }
-          break;
-
-        case (uint8_t)Memcached::OpCode::VERSION:
-          {
-            Memcached::VersionRsp* version_rsp =
-              new Memcached::VersionRsp((uint16_t)Memcached::ResultCode::NO_ERROR,
-                                        req->opaque(),
-                                        "1.6.0_beta1_106_g62c7e7a");
-            connection->send(*version_rsp);
-            delete version_rsp; version_rsp = NULL;
-          }
-          break;
-
-        default:
-          {
-            TRC_WARNING("Unrecognized operation: %d", req->op_code());
-            keep_going = false;
-          }
-          break;
+          queue_request(client, get_batch);
         }
       }
-      else
+      break;
+
+    case (uint8_t)Memcached::OpCode::ADD:
+    case (uint8_t)Memcached::OpCode::ADDQ:
+    case (uint8_t)Memcached::OpCode::SET:
+    case (uint8_t)Memcached::OpCode::SETQ:
+    case (uint8_t)Memcached::OpCode::REPLACE:
+    case (uint8_t)Memcached::OpCode::REPLACEQ:
+    case (uint8_t)Memcached::OpCode::DELETE:
+    case (uint8_t)Memcached::OpCode::DELETEQ:
       {
-        // We shouldn't receive responses. Break out of the loop so we'll close
-        // the connection.
-        TRC_WARNING("Received unexpected response with type: 0x%x", msg->op_code());
+        // These need to go to the backend, so pass them to the workers.
+        pthread_mutex_lock(&client->lock);
+        client->outstanding.insert(seq);
+        pthread_mutex_unlock(&client->lock);
+
+        Request request;
+        request.seqs.push_back(seq);
+        request.msgs.push_back(req);
+        msg = NULL;
+
+        queue_request(client, request);
+      }
+      break;
+
+    case (uint8_t)Memcached::OpCode::VERSION:
+      {
+        Memcached::VersionRsp* version_rsp =
+          new Memcached::VersionRsp((uint16_t)Memcached::ResultCode::NO_ERROR,
+                                    req->opaque(),
+                                    "1.6.0_beta1_106_g62c7e7a");
+        pthread_mutex_lock(&client->lock);
+        keep_going = (client->connection->write(*version_rsp) == Memcached::Status::OK);
+        pthread_mutex_unlock(&client->lock);
+        delete version_rsp; version_rsp = NULL;
+      }
+      break;
+
+    case (uint8_t)Memcached::OpCode::NOOP:
+      {
+        // Respond once all the earlier requests have completed (which may be
+        // straight away).
+        pthread_mutex_lock(&client->lock);
+        client->pending_noops.push_back(std::make_pair(seq, req->opaque()));
+        send_ready_noops(client);
+        pthread_mutex_unlock(&client->lock);
+      }
+      break;
+
+    default:
+      {
+        TRC_WARNING("Unrecognized operation: %d", req->op_code());
         keep_going = false;
       }
+      break;
+    }
+  }
+  else
+  {
+    // We shouldn't receive responses. Return false so we'll close the
+    // connection.
+    TRC_WARNING("Received unexpected response with type: 0x%x", msg->op_code());
+    keep_going = false;
+  }
+
+  // Delete the message unless it has been passed to the workers.
+  delete msg; msg = NULL;
+
+  return keep_going;
+}
+
+void ProxyServer::queue_request(Client* client, Request& request)
+{
+  if (request.msgs.empty())
+  {
+    return;
+  }
+
+  client->refs++;
+
+  pthread_mutex_lock(&_request_queue_lock);
+  _request_queue.push_back(Request());
+  _request_queue.back().client = client;
+  _request_queue.back().seqs.swap(request.seqs);
+  _request_queue.back().msgs.swap(request.msgs);
+  pthread_cond_signal(&_request_queue_cond);
+  pthread_mutex_unlock(&_request_queue_lock);
+}
+
+void ProxyServer::send_response(Client* client, const Memcached::BaseMessage& rsp)
+{
+  if (client->closed)
+  {
+    return;
+  }
+
+  if (client->connection->write(rsp) != Memcached::Status::OK)
+  {
+    // Only the I/O thread may close the connection. Shut the socket down so
+    // that the I/O thread notices and does so.
+    TRC_STATUS("Connection %s encountered an error",
+               client->connection->address().c_str());
+    shutdown(client->connection->sock(), SHUT_RDWR);
+  }
+}
+
+void ProxyServer::send_ready_noops(Client* client)
+{
+  while ((!client->pending_noops.empty()) &&
+         ((client->outstanding.empty()) ||
+          (*client->outstanding.begin() > client->pending_noops.front().first)))
+  {
+    Memcached::NoopRsp noop_rsp(client->pending_noops.front().second);
+    send_response(client, noop_rsp);
+    client->pending_noops.pop_front();
+  }
+}
+
+bool ProxyServer::suppress_response(const Memcached::BaseReq* req,
+                                    const Memcached::BaseRsp* rsp)
+{
+  if (!Memcached::is_quiet(req->op_code()))
+  {
+    return false;
+  }
+
+  // Quiet GETs only report hits (and errors). Other quiet requests only
+  // report failures.
+  uint8_t op_code = Memcached::unquiet(req->op_code());
+
+  if ((op_code == (uint8_t)Memcached::OpCode::GET) ||
+      (op_code == (uint8_t)Memcached::OpCode::GETK))
+  {
+    return (rsp->result_code() == (uint16_t)Memcached::ResultCode::KEY_NOT_FOUND);
+  }
+  else
+  {
+    return (rsp->result_code() == (uint16_t)Memcached::ResultCode::NO_ERROR);
+  }
+}
 
-      // We can delete the original message now.
-      delete msg; msg = NULL;
+void* ProxyServer::worker_thread_entry_point(void* server_param)
+{
+  ProxyServer* proxy_server = (ProxyServer*)server_param;
+  proxy_server->worker_thread_fn();
+  return NULL;
+}
+
+void ProxyServer::worker_thread_fn()
+{
+  while (true)
+  {
+    pthread_mutex_lock(&_request_queue_lock);
+    while (_request_queue.empty())
+    {
+      pthread_cond_wait(&_request_queue_cond, &_request_queue_lock);
     }
-    else if (status == Memcached::Status::DISCONNECTED)
+    Request request;
+    request.client = _request_queue.front().client;
+    request.seqs.swap(_request_queue.front().seqs);
+    request.msgs.swap(_request_queue.front().msgs);
+    _request_queue.pop_front();
+    pthread_mutex_unlock(&_request_queue_lock);
+
+    // Process the request even if the client has gone away in the meantime,
+    // as for a write it can't know whether or not the request was applied.
+    Client* client = request.client;
+    std::vector<Memcached::BaseRsp*> rsps;
+
+    if (request.msgs.size() > 1)
     {
-      TRC_STATUS("Client %s has disconnected", connection->address().c_str());
-      keep_going = false;
+      // Only GETs are batched.
+      handle_get_batch(request.msgs, rsps);
     }
     else
     {
-      TRC_STATUS("Connection %s encountered an error", connection->address().c_str());
-      keep_going = false;
+      rsps.push_back(process_request(request.msgs[0]));
+    }
+
+    // Responses are sent as soon as they are ready, so may go out in a
+    // different order to the requests. Clients match them up by opaque.
+    pthread_mutex_lock(&client->lock);
+
+    for (size_t ii = 0; ii < request.msgs.size(); ++ii)
+    {
+      client->outstanding.erase(request.seqs[ii]);
+
+      if ((rsps[ii] != NULL) && (!suppress_response(request.msgs[ii], rsps[ii])))
+      {
+        send_response(client, *rsps[ii]);
+      }
     }
+
+    // This may have been the last request a NOOP was waiting for.
+    send_ready_noops(client);
+
+    if (!update_epoll_events(client))
+    {
+      shutdown(client->connection->sock(), SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    for (size_t ii = 0; ii < request.msgs.size(); ++ii)
+    {
+      delete rsps[ii]; rsps[ii] = NULL;
+      delete request.msgs[ii]; request.msgs[ii] = NULL;
+    }
+    release_client(client); client = NULL;
+  }
+}
+
+Memcached::BaseRsp* ProxyServer::process_request(Memcached::BaseReq* req)
+{
+  Memcached::BaseRsp* rsp = NULL;
+
+  // Quiet requests are handled the same as their normal equivalents. It's
+  // up to the caller to decide whether to suppress the response.
+  switch (Memcached::unquiet(req->op_code()))
+  {
+  case (uint8_t)Memcached::OpCode::GET:
+  case (uint8_t)Memcached::OpCode::GETK:
+    rsp = handle_get(dynamic_cast<Memcached::GetReq*>(req));
+    break;
+
+  case (uint8_t)Memcached::OpCode::ADD:
+  case (uint8_t)Memcached::OpCode::SET:
+  case (uint8_t)Memcached::OpCode::REPLACE:
+    rsp = handle_set_add_replace(dynamic_cast<Memcached::SetAddReplaceReq*>(req));
+    break;
+
+  case (uint8_t)Memcached::OpCode::DELETE:
+    rsp = handle_delete(dynamic_cast<Memcached::DeleteReq*>(req));
+    break;
+
+  default:
+    // dispatch_request only passes us the operations above.
+    TRC_ERROR("Logical error - unexpected operation %d", req->op_code());
+    break;
   }
 
-  // If we fall out of the above loop for any reason, we should close the
-  // connection.
-  delete connection; connection = NULL;
+  return rsp;
 }
 
-void ProxyServer::handle_get(Memcached::GetReq* get_req,
-                             Memcached::ServerConnection* connection)
+Memcached::BaseRsp* ProxyServer::handle_get(Memcached::GetReq* get_req)
 {
   Memcached::ResultCode status;
   std::string value;
@@ -334,46 +822,76 @@ void ProxyServer::handle_get(Memcached::GetReq* get_req,
     key = get_req->key();
   }
 
-  Memcached::GetRsp* get_rsp =
-    new Memcached::GetRsp((uint16_t)status,
-                          get_req->opaque(),
-                          cas,
-                          value,
-                          0,
-                          key);
-  connection->send(*get_rsp);
-  delete get_rsp; get_rsp = NULL;
+  return new Memcached::GetRsp((uint16_t)status,
+                               get_req->opaque(),
+                               cas,
+                               value,
+                               0,
+                               key,
+                               get_req->op_code());
+}
+
+void ProxyServer::handle_get_batch(const std::vector<Memcached::BaseReq*>& get_reqs,
+                                   std::vector<Memcached::BaseRsp*>& rsps)
+{
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+  std::vector<uint64_t> cas;
+  std::vector<Memcached::ResultCode> statuses;
+
+  keys.reserve(get_reqs.size());
+  for (size_t ii = 0; ii < get_reqs.size(); ++ii)
+  {
+    keys.push_back(dynamic_cast<Memcached::GetReq*>(get_reqs[ii])->key());
+  }
+
+  _backend->read_data_multi(keys, values, cas, statuses);
+
+  rsps.clear();
+  rsps.reserve(get_reqs.size());
+  for (size_t ii = 0; ii < get_reqs.size(); ++ii)
+  {
+    Memcached::GetReq* get_req = dynamic_cast<Memcached::GetReq*>(get_reqs[ii]);
+    std::string key;
+
+    if (get_req->response_needs_key())
+    {
+      key = get_req->key();
+    }
+
+    rsps.push_back(new Memcached::GetRsp((uint16_t)statuses[ii],
+                                         get_req->opaque(),
+                                         cas[ii],
+                                         values[ii],
+                                         0,
+                                         key,
+                                         get_req->op_code()));
+  }
 }
 
-void ProxyServer::handle_set_add_replace(Memcached::SetAddReplaceReq* sar_req,
-                                         Memcached::ServerConnection* connection)
+Memcached::BaseRsp*
+ProxyServer::handle_set_add_replace(Memcached::SetAddReplaceReq* sar_req)
 {
   Memcached::ResultCode status;
 
-  status = _backend->write_data((Memcached::OpCode)sar_req->op_code(),
+  status = _backend->write_data((Memcached::OpCode)Memcached::unquiet(sar_req->op_code()),
                                 sar_req->key(),
                                 sar_req->value(),
                                 sar_req->cas(),
                                 sar_req->expiry());
 
-  Memcached::SetAddReplaceRsp* sar_rsp =
-    new Memcached::SetAddReplaceRsp((uint8_t)sar_req->op_code(),
-                                    (uint16_t)status,
-                                    sar_req->opaque());
-  connection->send(*sar_rsp);
-  delete sar_rsp; sar_rsp = NULL;
+  return new Memcached::SetAddReplaceRsp((uint8_t)sar_req->op_code(),
+                                         (uint16_t)status,
+                                         sar_req->opaque());
 }
 
-void ProxyServer::handle_delete(Memcached::DeleteReq* delete_req,
-                                Memcached::ServerConnection* connection)
+Memcached::BaseRsp* ProxyServer::handle_delete(Memcached::DeleteReq* delete_req)
 {
   Memcached::ResultCode status;
 
   status = _backend->delete_data(delete_req->key());
 
-  Memcached::DeleteRsp* delete_rsp =
-    new Memcached::DeleteRsp((uint16_t)status, delete_req->opaque());
-
-  connection->send(*delete_rsp);
-  delete delete_rsp; delete_rsp = NULL;
+  return new Memcached::DeleteRsp((uint16_t)status,
+                                  delete_req->opaque(),
+                                  delete_req->op_code());
 }
@@ -0,0 +1,215 @@
+/**
+ * @file rate_limiter.cpp - Token bucket rate limiter
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "rate_limiter.hpp"
+#include "log.h"
+
+#include <algorithm>
+
+RateLimiter::RateLimiter(uint64_t rate) :
+  _rate(rate),
+  _tokens(rate)
+{
+  pthread_mutex_init(&_lock, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &_last_refill);
+}
+
+RateLimiter::~RateLimiter()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void RateLimiter::consume(uint64_t tokens)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_rate == 0)
+  {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+
+  refill();
+
+  // Take the tokens now, even if this leaves the bucket in debt, and then wait
+  // for the debt to be paid off. Later callers have to wait for this debt as
+  // well as their own, which keeps the rate correct however many threads are
+  // waiting.
+  _tokens -= tokens;
+  double wait = (_tokens < 0) ? (-_tokens / _rate) : 0;
+
+  pthread_mutex_unlock(&_lock);
+
+  if (wait > 0)
+  {
+    struct timespec ts;
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait - ts.tv_sec) * 1000000000);
+    while (nanosleep(&ts, &ts) != 0)
+    {
+      // Interrupted by a signal - sleep for the rest of the time.
+    }
+  }
+}
+
+void RateLimiter::set_rate(uint64_t rate)
+{
+  pthread_mutex_lock(&_lock);
+
+  // Bring the bucket up to date at the old rate before changing it.
+  refill();
+
+  if (_rate == 0)
+  {
+    // There was no limit, so start with a full bucket.
+    _tokens = rate;
+  }
+  _rate = rate;
+
+  pthread_mutex_unlock(&_lock);
+}
+
+uint64_t RateLimiter::rate()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t rate = _rate;
+  pthread_mutex_unlock(&_lock);
+  return rate;
+}
+
+// Add the tokens that have accumulated since the last refill. The lock must be
+// held to call this function.
+void RateLimiter::refill()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  double elapsed = (now.tv_sec - _last_refill.tv_sec) +
+                   (now.tv_nsec - _last_refill.tv_nsec) / 1000000000.0;
+  _last_refill = now;
+
+  _tokens += elapsed * _rate;
+  if (_tokens > _rate)
+  {
+    _tokens = _rate;
+  }
+}
+
+LatencyController::LatencyController(RateLimiter* limiter,
+                                     uint64_t max_rate,
+                                     uint64_t target_latency_us) :
+  _limiter(limiter),
+  _max_rate(max_rate),
+  _min_rate(std::max(max_rate / 100, (uint64_t)1)),
+  _target_latency_us(target_latency_us),
+  _rate(max_rate),
+  _latencies()
+{
+  pthread_mutex_init(&_lock, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &_period_start);
+}
+
+LatencyController::~LatencyController()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool LatencyController::record_latency(uint64_t latency_us)
+{
+  if ((_target_latency_us == 0) || (_max_rate == 0))
+  {
+    // There's nothing to adjust.
+    return false;
+  }
+
+  bool changed = false;
+  pthread_mutex_lock(&_lock);
+
+  _latencies.push_back(latency_us);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t elapsed_us = (now.tv_sec - _period_start.tv_sec) * 1000000 +
+                        (now.tv_nsec - _period_start.tv_nsec) / 1000;
+
+  if (elapsed_us >= PERIOD_US)
+  {
+    // Work out the 99th percentile latency over the period.
+    std::vector<uint64_t>::iterator p99 =
+      _latencies.begin() + (_latencies.size() * 99) / 100;
+    std::nth_element(_latencies.begin(), p99, _latencies.end());
+
+    uint64_t rate = _rate;
+    if (*p99 > _target_latency_us)
+    {
+      rate = std::max(_rate / 2, _min_rate);
+    }
+    else
+    {
+      rate = std::min(_rate + std::max(_max_rate / 20, (uint64_t)1), _max_rate);
+    }
+
+    if (rate != _rate)
+    {
+      TRC_DEBUG("99th percentile latency is %lluus - change rate from %llu to %llu",
+                (unsigned long long)*p99,
+                (unsigned long long)_rate,
+                (unsigned long long)rate);
+      _rate = rate;
+      _limiter->set_rate(rate);
+      changed = true;
+    }
+
+    _latencies.clear();
+    _period_start = now;
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return changed;
+}
+
+uint32_t LatencyController::level()
+{
+  if (_max_rate == 0)
+  {
+    return 100;
+  }
+
+  pthread_mutex_lock(&_lock);
+  uint32_t level = (_rate * 100) / _max_rate;
+  pthread_mutex_unlock(&_lock);
+  return level;
+}